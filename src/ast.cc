@@ -0,0 +1,31 @@
+#include "parser.h"
+
+namespace TeX {
+AST::AST(NodeList tokens) : nodes(std::move(tokens)), partner(nodes.size(), none) {
+    if (nodes.size() >= none) throw ProcessingError("Too many tokens");
+
+    /// Groups and environments are matched independently, so
+    /// e.g. a "}" in an environment can't close it early.
+    std::vector<U32> groups;
+    std::vector<U32> envs;
+    auto             Close = [&](std::vector<U32>& open, U32 index) {
+        if (open.empty()) return;
+        partner[open.back()] = index;
+        partner[index]       = open.back();
+        open.pop_back();
+    };
+
+    for (U32 i = 0; i < nodes.size(); i++) {
+        const auto& node = nodes[i];
+        switch (node.type) {
+            case TokenType::GroupBegin: groups.push_back(i); break;
+            case TokenType::GroupEnd: Close(groups, i); break;
+            case TokenType::CommandSequence:
+                if (node.string_content == U"\\begin") envs.push_back(i);
+                else if (node.string_content == U"\\end") Close(envs, i);
+                break;
+            default: break;
+        }
+    }
+}
+} // namespace TeX
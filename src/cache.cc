@@ -0,0 +1,170 @@
+#include "cli.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace TeX::cli {
+namespace fs = std::filesystem;
+
+/// Bump this whenever a change to xpp changes its output.
+constexpr std::string_view cache_version = "xpp-cache-1";
+
+auto ReadFile(const fs::path& path) -> std::optional<std::string> {
+    std::ifstream f{path, std::ios::binary};
+    if (!f) return std::nullopt;
+    std::stringstream contents;
+    contents << f.rdbuf();
+    if (auto c = DetectCompression(contents.view()); c != Compression::None) {
+        try {
+            return Decompress(contents.view(), c);
+        } catch (const ProcessingError&) {
+            return std::nullopt;
+        }
+    }
+    return std::move(contents).str();
+}
+
+/// Write a file atomically so that concurrent readers never see a partial file.
+void WriteFileAtomic(const fs::path& path, std::string_view contents) {
+    static std::atomic<U64> counter = 0;
+    auto       tmp     = path;
+    tmp += ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+
+    std::error_code ec;
+    {
+        std::ofstream f{tmp, std::ios::binary};
+        if (!f) return;
+        f.write(contents.data(), std::streamsize(contents.size()));
+        if (!f) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+
+    fs::rename(tmp, path, ec);
+    if (ec) fs::remove(tmp, ec);
+}
+
+OutputCache::OutputCache(fs::path _dir, U64 _max_size, const std::string& input, std::string_view options)
+    : dir(std::move(_dir)), max_size(_max_size) {
+    auto contents = ReadFile(input);
+    if (!contents) Die("Could not read input file %s", input.c_str());
+
+    std::string data{cache_version};
+    data += '\0';
+    data += options;
+    data += '\0';
+    data += HashHex(*contents);
+    key = HashHex(data);
+
+    std::error_code ec;
+    fs::create_directories(dir / "manifests", ec);
+    fs::create_directories(dir / "results", ec);
+    if (ec) Die("Could not create cache directory %s: %s", dir.c_str(), ec.message().c_str());
+}
+
+auto OutputCache::ManifestPath() const -> fs::path {
+    return dir / "manifests" / key;
+}
+
+auto OutputCache::ResultPath(const std::vector<std::string>& includes) const -> std::optional<fs::path> {
+    std::string data = key;
+    for (const auto& path : includes) {
+        auto contents = ReadFile(path);
+        if (!contents) return std::nullopt;
+        data += '\0';
+        data += path;
+        data += '\0';
+        data += HashHex(*contents);
+    }
+    return dir / "results" / HashHex(data);
+}
+
+auto OutputCache::Lookup(std::vector<std::string>& includes) -> std::optional<fs::path> {
+    auto manifest = ReadFile(ManifestPath());
+    if (!manifest) return std::nullopt;
+
+    /// The manifest contains one included file per line.
+    std::vector<std::string> paths;
+    std::istringstream       lines{std::move(*manifest)};
+    for (std::string line; std::getline(lines, line);) paths.push_back(std::move(line));
+
+    auto result = ResultPath(paths);
+    if (!result || !fs::exists(*result)) return std::nullopt;
+
+    /// Mark the result and the manifest that leads to it as recently used for eviction.
+    std::error_code ec;
+    auto            now = fs::file_time_type::clock::now();
+    fs::last_write_time(*result, now, ec);
+    fs::last_write_time(ManifestPath(), now, ec);
+    includes.insert(includes.end(), paths.begin(), paths.end());
+    return result;
+}
+
+void OutputCache::Store(std::string_view output, std::span<const std::string> includes) {
+    std::vector<std::string> paths{includes.begin(), includes.end()};
+    auto                     result = ResultPath(paths);
+    if (!result) return;
+
+    std::string manifest;
+    for (const auto& path : paths) manifest += path + "\n";
+
+    /// Write the result first so a reader that sees the
+    /// manifest can also find the result.
+    WriteFileAtomic(*result, output);
+    WriteFileAtomic(ManifestPath(), manifest);
+    Evict();
+}
+
+void OutputCache::Evict() {
+    /// Only one process needs to evict at a time; if someone
+    /// else is already doing it, leave it to them.
+    auto lock_path = dir / "lock";
+    int  lock      = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        close(lock);
+        return;
+    }
+
+    struct entry {
+        fs::path           path;
+        U64                size;
+        fs::file_time_type time;
+    };
+
+    std::vector<entry> entries;
+    U64                total = 0;
+    std::error_code    ec;
+    for (auto sub : {"manifests", "results"}) {
+        for (const auto& e : fs::directory_iterator{dir / sub, ec}) {
+            /// Leave files that are still being written alone.
+            if (e.path().filename().string().find(".tmp.") != std::string::npos) continue;
+            auto size = e.file_size(ec);
+            if (ec) continue;
+            entries.push_back({e.path(), size, e.last_write_time(ec)});
+            total += size;
+        }
+    }
+
+    /// Delete the least recently used entries until we're well below
+    /// the limit so we don't have to evict again on every store.
+    if (total > max_size) {
+        std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.time < b.time; });
+        const U64 target = max_size / 10 * 9;
+        for (const auto& e : entries) {
+            if (total <= target) break;
+            if (fs::remove(e.path, ec)) total -= e.size;
+        }
+    }
+
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+} // namespace TeX::cli
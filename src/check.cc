@@ -0,0 +1,210 @@
+#include "cli.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+namespace TeX::cli {
+namespace {
+/// Number of lines of context around each hunk of a diff.
+constexpr U64 diff_context = 3;
+
+/// Give up on finding a minimal diff after this many edits and treat
+/// the rest of the lines as changed; the diff is still correct.
+constexpr I64 max_diff_edits = 2'000;
+
+struct CheckResult {
+    bool        formatted = true;
+    std::string diff;
+    std::string error;
+};
+
+auto SplitLines(std::string_view text) -> std::vector<std::string_view> {
+    std::vector<std::string_view> lines;
+    while (!text.empty()) {
+        auto nl = text.find('\n');
+        lines.push_back(text.substr(0, nl));
+        text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+    }
+    return lines;
+}
+
+enum struct Edit : char {
+    Keep   = ' ',
+    Delete = '-',
+    Insert = '+',
+};
+
+/// Compute a shortest edit script between two sequences of lines
+/// using Myers' algorithm.
+auto DiffLines(const std::vector<std::string_view>& a, const std::vector<std::string_view>& b) -> std::vector<Edit> {
+    /// Strip the common prefix and suffix; they're usually most of the file.
+    U64 prefix = 0, suffix = 0;
+    while (prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix]) prefix++;
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix && a[a.size() - suffix - 1] == b[b.size() - suffix - 1]) suffix++;
+
+    const I64 n = I64(a.size() - prefix - suffix);
+    const I64 m = I64(b.size() - prefix - suffix);
+    auto      A = [&](I64 i) { return a[prefix + U64(i)]; };
+    auto      B = [&](I64 j) { return b[prefix + U64(j)]; };
+
+    /// v[k] is the furthest x reached on diagonal k; trace[d] is v after d edits.
+    std::vector<std::vector<I64>> trace;
+    std::vector<I64>              v(U64(2 * std::min(n + m, max_diff_edits) + 3), 0);
+    const I64                     offset = std::min(n + m, max_diff_edits) + 1;
+    I64                           d      = 0;
+    bool                          found  = n == 0 && m == 0;
+    for (; !found && d <= std::min(n + m, max_diff_edits); d++) {
+        for (I64 k = -d; k <= d; k += 2) {
+            I64 x = k == -d || (k != d && v[U64(offset + k - 1)] < v[U64(offset + k + 1)])
+                      ? v[U64(offset + k + 1)]
+                      : v[U64(offset + k - 1)] + 1;
+            I64 y = x - k;
+            while (x < n && y < m && A(x) == B(y)) x++, y++;
+            v[U64(offset + k)] = x;
+            if (x >= n && y >= m) found = true;
+        }
+        /// Only diagonals -d - 1 to d + 1 are needed to walk back through step d.
+        trace.emplace_back(v.begin() + (offset - d - 1), v.begin() + (offset + d + 2));
+    }
+
+    std::vector<Edit> edits(prefix, Edit::Keep);
+    std::vector<Edit> middle;
+    if (!found) {
+        /// Too many differences; replace the entire middle.
+        middle.assign(U64(n), Edit::Delete);
+        middle.insert(middle.end(), U64(m), Edit::Insert);
+    } else {
+        /// Walk back through the trace to recover the edits.
+        I64 x = n, y = m;
+        for (I64 e = I64(trace.size()) - 1; e > 0; e--) {
+            /// Diagonal k of step e - 1 is at index k + e.
+            const auto& prev = trace[U64(e - 1)];
+            const I64   k    = x - y;
+            const I64   pk   = k == -e || (k != e && prev[U64(k - 1 + e)] < prev[U64(k + 1 + e)]) ? k + 1 : k - 1;
+            const I64   px   = prev[U64(pk + e)];
+            const I64   py   = px - pk;
+            while (x > px && y > py) {
+                middle.push_back(Edit::Keep);
+                x--, y--;
+            }
+            middle.push_back(x == px ? Edit::Insert : Edit::Delete);
+            x = px, y = py;
+        }
+        while (x > 0 && y > 0) {
+            middle.push_back(Edit::Keep);
+            x--, y--;
+        }
+        std::reverse(middle.begin(), middle.end());
+    }
+
+    edits.insert(edits.end(), middle.begin(), middle.end());
+    edits.insert(edits.end(), suffix, Edit::Keep);
+    return edits;
+}
+
+/// Render a unified diff between a file and its formatted version.
+auto UnifiedDiff(const std::string& path, std::string_view original, std::string_view formatted) -> std::string {
+    auto a     = SplitLines(original);
+    auto b     = SplitLines(formatted);
+    auto edits = DiffLines(a, b);
+
+    std::string out = "--- " + path + "\n+++ " + path + " (formatted)\n";
+    for (U64 i = 0, ai = 0, bi = 0; i < edits.size();) {
+        if (edits[i] == Edit::Keep) {
+            i++, ai++, bi++;
+            continue;
+        }
+
+        /// Extend the hunk until we find more than twice the context of unchanged lines.
+        U64 start = i - std::min(i, diff_context);
+        U64 end   = i;
+        for (U64 keep = 0; end < edits.size() && keep <= 2 * diff_context; end++)
+            keep = edits[end] == Edit::Keep ? keep + 1 : 0;
+        while (end > i && edits[end - 1] == Edit::Keep) end--;
+        end = std::min(end + diff_context, edits.size());
+
+        U64 a_start = ai - (i - start), b_start = bi - (i - start), a_count = 0, b_count = 0;
+        for (U64 j = start; j < end; j++) {
+            if (edits[j] != Edit::Insert) a_count++;
+            if (edits[j] != Edit::Delete) b_count++;
+        }
+
+        out += "@@ -" + std::to_string(a_start + (a_count != 0)) + "," + std::to_string(a_count);
+        out += " +" + std::to_string(b_start + (b_count != 0)) + "," + std::to_string(b_count) + " @@\n";
+        for (U64 j = start, x = a_start, y = b_start; j < end; j++) {
+            out += char(edits[j]);
+            out += edits[j] == Edit::Insert ? b[y] : a[x];
+            out += '\n';
+            if (edits[j] != Edit::Insert) x++;
+            if (edits[j] != Edit::Delete) y++;
+        }
+
+        ai = a_start + a_count;
+        bi = b_start + b_count;
+        i  = end;
+    }
+    return out;
+}
+
+auto CheckFile(const std::string& path, const Options& opts, const FormatRules& rules, bool diff) -> CheckResult {
+    CheckResult result;
+    try {
+        /// Format and compare against the same decompressed contents, so the
+        /// file is only read once.
+        auto contents = ReadInput(path);
+        if (!contents) throw ProcessingError("Could not read file " + path + ": " + strerror(errno));
+
+        Parser p{path, opts, *contents};
+        p.format_rules = &rules;
+        if (!diff) result.formatted = p.CheckFormat(*contents);
+        else if (auto formatted = p.Format(); formatted != *contents) {
+            result.formatted = false;
+            result.diff      = UnifiedDiff(path, *contents, formatted);
+        }
+    } catch (const ProcessingError& e) {
+        result.formatted = false;
+        result.error     = e.what();
+    }
+    return result;
+}
+} // namespace
+
+int Check(const Options& opts) {
+    if (options::get<"-o">() || options::get<"-MD">() || options::get<"-MF">() || options::get<"--watch">()
+        || options::get<"--wc">() || options::get<"--print-tokens">() || options::get<"--cache-dir">())
+        Die("--check can't be combined with options that produce output");
+
+    const auto* files = options::get<"file">();
+    if (!files) Die("--check requires at least one input file");
+    const bool        diff = options::get<"--diff">();
+    const FormatRules rules{opts};
+
+    /// Check the files on a pool of threads.
+    std::vector<CheckResult> results(files->size());
+    std::atomic<U64>         next = 0;
+    auto                     Work = [&] {
+        for (U64 i; (i = next.fetch_add(1, std::memory_order_relaxed)) < files->size();)
+            results[i] = CheckFile((*files)[i], opts, rules, diff);
+    };
+
+    std::vector<std::thread> pool;
+    const U64                threads = std::min<U64>(files->size(), std::max(1u, std::thread::hardware_concurrency()));
+    for (U64 i = 1; i < threads; i++) pool.emplace_back(Work);
+    Work();
+    for (auto& t : pool) t.join();
+
+    /// Report the results in the order the files were given.
+    int status = 0;
+    for (U64 i = 0; i < files->size(); i++) {
+        const auto& r = results[i];
+        if (r.formatted) continue;
+        status = 1;
+        if (!r.error.empty()) std::cerr << r.error << "\n";
+        else if (diff) std::cout << r.diff;
+        else std::cout << (*files)[i] << "\n";
+    }
+    return status;
+}
+} // namespace TeX::cli
@@ -0,0 +1,114 @@
+#ifndef XPP_CLI_H
+#define XPP_CLI_H
+
+#include "../clopts/include/clopts.hh"
+#include "parser.h"
+
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+
+/// Command-line driver. Everything that deals with command-line
+/// options and output files lives here rather than in libxpp.
+namespace TeX::cli {
+namespace cl = command_line_options;
+using options = cl::clopts<
+    cl::multiple<cl::positional<"file", "The file to process, or '-' for stdin; --check accepts several", std::string>>,
+    cl::option<"-o", "The file to output to">,
+    cl::option<"--line-width", "The maximum line width", I64>,
+    cl::multiple<cl::option<"--enumerate-env", "Define an environment to be indented like enumerate">>,
+    cl::option<"--format-rules", "File containing additional formatting rules">,
+    cl::flag<"--print-tokens", "Print all tokens to stdout and exit">,
+    cl::option<"--emit-preprocessed", "Write the preprocessed file here; can be combined with the other --emit options">,
+    cl::option<"--emit-formatted", "Write the formatted file here; can be combined with the other --emit options">,
+    cl::option<"--emit-wc", "Write the number of characters and words as JSON here; can be combined with the other --emit options">,
+    cl::flag<"--binary", "With --print-tokens, write a binary token dump that can be used as input instead of a .tex file">,
+    cl::flag<"--wc", "Count the number of characters and words in the file">,
+    cl::flag<"--format", "Format a file instead of preprocessing it">,
+    cl::option<"--profile-macros", "Write a profile of macro expansions to this file, and call chains for flamegraph.pl to the same file with '.folded' appended">,
+    cl::flag<"--pipeline", "Run parsing, text merging and emission as concurrent stages">,
+    cl::flag<"--prefetch-includes", "Read included files ahead of time on background threads">,
+    cl::flag<"--parallel-lex", "Lex large input files on several threads">,
+    cl::flag<"--parallel-emit", "Construct and encode the output of large documents on several threads">,
+    cl::flag<"-MD", "Write a Make-style dependency file to the output file name with '.d' appended">,
+    cl::option<"-MF", "Write a Make-style dependency file to this file">,
+    cl::flag<"--only-if-changed", "Leave the output file untouched if its contents wouldn't change">,
+    cl::option<"--cache-dir", "Directory in which to cache outputs">,
+    cl::option<"--cache-size", "Maximum size of the cache directory in MiB", I64>,
+    cl::flag<"--watch", "Keep running and reprocess the input whenever it or a file it includes changes">,
+    cl::flag<"--check", "Check that files are formatted; list the ones that aren't and exit with status 1">,
+    cl::flag<"--diff", "With --check, print a unified diff instead of a list of files">,
+    cl::flag<"--unused-macros", "Print the macros that are defined but never used to stderr">,
+    cl::flag<"--stats", "Print whether the input was copied to the output unchanged, and how much of it was scanned to decide, to stderr">,
+    cl::help>;
+
+/// Content-addressed cache of outputs, shared between xpp processes.
+///
+/// The input file and options are hashed to find a manifest listing the
+/// files that the input included the last time it was processed; the
+/// result is then keyed on the hashes of those files. Since the files
+/// that are included depend only on the contents of the files included
+/// before them, this finds a result iff all of them are unchanged.
+class OutputCache {
+    std::filesystem::path dir;
+    U64                   max_size;
+    std::string           key;
+
+    auto ManifestPath() const -> std::filesystem::path;
+    auto ResultPath(const std::vector<std::string>& includes) const -> std::optional<std::filesystem::path>;
+    void Evict();
+
+public:
+    OutputCache(std::filesystem::path dir, U64 max_size, const std::string& input, std::string_view options);
+
+    /// Look up the result for the input. On a hit, the files included
+    /// by the input are appended to \p includes.
+    auto Lookup(std::vector<std::string>& includes) -> std::optional<std::filesystem::path>;
+
+    /// Store the result for the input. \p includes are the files
+    /// that were included while processing it.
+    void Store(std::string_view output, std::span<const std::string> includes);
+};
+
+/// Read an entire file, decompressing it if it's compressed. Returns
+/// nullopt if it can't be read.
+auto ReadFile(const std::filesystem::path& path) -> std::optional<std::string>;
+
+/// Build the library options from the command line.
+auto MakeOptions() -> Options;
+
+/// Write the contents of a file, e.g. a cached result, to the output file.
+/// Returns false if the file can't be read, e.g. because it was evicted.
+bool CopyToOutput(const std::filesystem::path& result, const std::vector<std::string>& dependencies);
+
+/// If preprocessing a file wouldn't change it, copy it to the output
+/// file and return true.
+bool PassThrough(const std::string& file);
+
+/// Print the statistics shown by --stats.
+void PrintStats();
+
+/// Write the output and then the dependency file, if requested. Only
+/// call this once processing has succeeded: if there was an error,
+/// neither file should be touched.
+void WriteOutput(std::string_view text, const std::vector<std::string>& dependencies);
+
+/// Write a file, or die. The contents are compressed if the file name
+/// ends with '.gz' or '.zst'.
+void WriteFile(const std::string& path, std::string_view contents);
+
+/// Produce the outputs requested with --emit-*.
+int EmitAll(const std::string& file, const Options& opts);
+
+/// Write the report and folded call stacks of --profile-macros.
+void WriteProfile(const MacroProfiler& profiler, const std::string& path);
+
+/// Run in --check mode.
+int Check(const Options& opts);
+
+/// Run in --watch mode.
+[[noreturn]] void Watch(const std::string& file, const Options& opts);
+} // namespace TeX::cli
+
+#endif // XPP_CLI_H
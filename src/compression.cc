@@ -0,0 +1,209 @@
+#include "compression.h"
+
+#include "parser.h"
+
+#include <zlib.h>
+
+#ifdef XPP_HAVE_ZSTD
+#    include <zstd.h>
+#endif
+
+namespace TeX {
+namespace {
+/// Size of the buffer that (de)compressed data is written to before
+/// being appended to the output.
+constexpr std::size_t compression_buffer_size = 64 * 1024;
+
+/// Maximum amount of data passed to zlib at once, whose sizes are 32-bit.
+constexpr std::size_t compression_input_size = 1 << 20;
+
+class GzipDecompressor : public Decompressor {
+    z_stream zs{};
+
+    /// Whether we're between two members of a multi-member file.
+    bool at_member_end = false;
+
+public:
+    GzipDecompressor() {
+        /// 15 + 32 detects gzip and zlib headers automatically.
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) throw ProcessingError("Could not initialise zlib");
+    }
+
+    ~GzipDecompressor() override { inflateEnd(&zs); }
+
+    void Decompress(std::string_view in, std::string& out) override {
+        char buffer[compression_buffer_size];
+        zs.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        zs.avail_in = uInt(in.size());
+
+        /// Keep going while the buffer is filled, even if all of the input
+        /// has been consumed, since zlib may still hold decoded data.
+        do {
+            /// A gzip file may consist of several concatenated members.
+            if (at_member_end) {
+                if (!zs.avail_in) break;
+                inflateReset(&zs);
+                at_member_end = false;
+            }
+
+            zs.next_out  = reinterpret_cast<Bytef*>(buffer);
+            zs.avail_out = uInt(sizeof buffer);
+            auto ret     = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                throw ProcessingError(std::string{"Invalid gzip data: "} + (zs.msg ? zs.msg : "unknown error"));
+            out.append(buffer, sizeof buffer - zs.avail_out);
+            if (ret == Z_STREAM_END) at_member_end = true;
+        } while (zs.avail_in || zs.avail_out == 0);
+    }
+
+    void Finish(std::string& out) override {
+        Decompress({}, out);
+        if (!at_member_end) throw ProcessingError("Truncated gzip data");
+    }
+};
+
+class GzipCompressor : public Compressor {
+    z_stream zs{};
+
+    void Deflate(std::string_view in, std::string& out, int flush) {
+        char buffer[compression_buffer_size];
+        zs.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        zs.avail_in = uInt(in.size());
+        do {
+            zs.next_out  = reinterpret_cast<Bytef*>(buffer);
+            zs.avail_out = uInt(sizeof buffer);
+            deflate(&zs, flush);
+            out.append(buffer, sizeof buffer - zs.avail_out);
+        } while (zs.avail_out == 0);
+    }
+
+public:
+    GzipCompressor() {
+        /// 15 + 16 writes a gzip header rather than a zlib header.
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw ProcessingError("Could not initialise zlib");
+    }
+
+    ~GzipCompressor() override { deflateEnd(&zs); }
+
+    void Compress(std::string_view in, std::string& out) override { Deflate(in, out, Z_NO_FLUSH); }
+    void Finish(std::string& out) override { Deflate({}, out, Z_FINISH); }
+};
+
+#ifdef XPP_HAVE_ZSTD
+class ZstdDecompressor : public Decompressor {
+    ZSTD_DCtx* ctx;
+
+    /// Return value of the last call to ZSTD_decompressStream(); 0 if
+    /// a frame has been decoded completely.
+    std::size_t pending = 0;
+
+public:
+    ZstdDecompressor() : ctx(ZSTD_createDCtx()) {
+        if (!ctx) throw ProcessingError("Could not initialise zstd");
+    }
+
+    ~ZstdDecompressor() override { ZSTD_freeDCtx(ctx); }
+
+    void Decompress(std::string_view in, std::string& out) override {
+        char           buffer[compression_buffer_size];
+        ZSTD_inBuffer  input{in.data(), in.size(), 0};
+        ZSTD_outBuffer output{};
+
+        /// zstd consumes a whole block before it writes any of it, so the
+        /// input can run out while decoded data is still waiting to be
+        /// flushed; keep going for as long as the buffer is filled and
+        /// the frame isn't done.
+        do {
+            output  = {buffer, sizeof buffer, 0};
+            pending = ZSTD_decompressStream(ctx, &output, &input);
+            if (ZSTD_isError(pending)) throw ProcessingError(std::string{"Invalid zstd data: "} + ZSTD_getErrorName(pending));
+            out.append(buffer, output.pos);
+        } while (input.pos < input.size || (output.pos == output.size && pending != 0));
+    }
+
+    void Finish(std::string& out) override {
+        if (pending != 0) Decompress({}, out);
+        if (pending != 0) throw ProcessingError("Truncated zstd data");
+    }
+};
+
+class ZstdCompressor : public Compressor {
+    ZSTD_CCtx* ctx;
+
+    void Stream(std::string_view in, std::string& out, ZSTD_EndDirective mode) {
+        char          buffer[compression_buffer_size];
+        ZSTD_inBuffer input{in.data(), in.size(), 0};
+        for (;;) {
+            ZSTD_outBuffer output{buffer, sizeof buffer, 0};
+            auto           remaining = ZSTD_compressStream2(ctx, &output, &input, mode);
+            if (ZSTD_isError(remaining)) throw ProcessingError(std::string{"Could not compress output: "} + ZSTD_getErrorName(remaining));
+            out.append(buffer, output.pos);
+            if (mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size) break;
+        }
+    }
+
+public:
+    ZstdCompressor() : ctx(ZSTD_createCCtx()) {
+        if (!ctx) throw ProcessingError("Could not initialise zstd");
+    }
+
+    ~ZstdCompressor() override { ZSTD_freeCCtx(ctx); }
+
+    void Compress(std::string_view in, std::string& out) override { Stream(in, out, ZSTD_e_continue); }
+    void Finish(std::string& out) override { Stream({}, out, ZSTD_e_end); }
+};
+#else
+[[noreturn]] void NoZstd() {
+    throw ProcessingError("xpp was built without zstd support");
+}
+#endif
+} // namespace
+
+auto DetectCompression(std::string_view data) -> Compression {
+    if (data.starts_with("\x1f\x8b")) return Compression::Gzip;
+    if (data.starts_with("\x28\xb5\x2f\xfd")) return Compression::Zstd;
+    return Compression::None;
+}
+
+auto CompressionForPath(std::string_view path) -> Compression {
+    if (path.ends_with(".gz")) return Compression::Gzip;
+    if (path.ends_with(".zst")) return Compression::Zstd;
+    return Compression::None;
+}
+
+auto Decompressor::Create(Compression c) -> std::unique_ptr<Decompressor> {
+    switch (c) {
+        case Compression::None: return nullptr;
+        case Compression::Gzip: return std::make_unique<GzipDecompressor>();
+#ifdef XPP_HAVE_ZSTD
+        case Compression::Zstd: return std::make_unique<ZstdDecompressor>();
+#else
+        case Compression::Zstd: NoZstd();
+#endif
+    }
+    Unreachable("Decompressor::Create");
+}
+
+auto Compressor::Create(Compression c) -> std::unique_ptr<Compressor> {
+    switch (c) {
+        case Compression::None: return nullptr;
+        case Compression::Gzip: return std::make_unique<GzipCompressor>();
+#ifdef XPP_HAVE_ZSTD
+        case Compression::Zstd: return std::make_unique<ZstdCompressor>();
+#else
+        case Compression::Zstd: NoZstd();
+#endif
+    }
+    Unreachable("Compressor::Create");
+}
+
+auto Decompress(std::string_view data, Compression c) -> std::string {
+    std::string out;
+    auto        d = Decompressor::Create(c);
+    for (std::size_t pos = 0; pos < data.size(); pos += compression_input_size)
+        d->Decompress(data.substr(pos, compression_input_size), out);
+    d->Finish(out);
+    return out;
+}
+} // namespace TeX
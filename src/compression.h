@@ -0,0 +1,54 @@
+#ifndef XPP_COMPRESSION_H
+#define XPP_COMPRESSION_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace TeX {
+enum struct Compression {
+    None,
+    Gzip,
+    Zstd,
+};
+
+/// Detect whether data is compressed from its first four bytes.
+auto DetectCompression(std::string_view data) -> Compression;
+
+/// Compression implied by the extension of a file name: '.gz' or '.zst'.
+auto CompressionForPath(std::string_view path) -> Compression;
+
+/// Incremental decompression. Errors are thrown as ProcessingError.
+class Decompressor {
+public:
+    virtual ~Decompressor() = default;
+
+    /// Decompress \p in, appending the result to \p out.
+    virtual void Decompress(std::string_view in, std::string& out) = 0;
+
+    /// Append any output that is still pending to \p out, and check that
+    /// the input didn't end in the middle of a compressed stream.
+    virtual void Finish(std::string& out) = 0;
+
+    static auto Create(Compression c) -> std::unique_ptr<Decompressor>;
+};
+
+/// Incremental compression. Errors are thrown as ProcessingError.
+class Compressor {
+public:
+    virtual ~Compressor() = default;
+
+    /// Compress \p in, appending whatever output is ready to \p out.
+    virtual void Compress(std::string_view in, std::string& out) = 0;
+
+    /// Append the rest of the output to \p out.
+    virtual void Finish(std::string& out) = 0;
+
+    static auto Create(Compression c) -> std::unique_ptr<Compressor>;
+};
+
+/// Decompress an entire buffer.
+auto Decompress(std::string_view data, Compression c) -> std::string;
+} // namespace TeX
+
+#endif // XPP_COMPRESSION_H
@@ -0,0 +1,41 @@
+#include "format_rules.h"
+
+namespace TeX {
+FormatRules::FormatRules(const Options& opts) {
+    enumerate_envs.insert("enumerate");
+    enumerate_envs.insert("itemize");
+    enumerate_envs.insert(opts.enumerate_envs.begin(), opts.enumerate_envs.end());
+
+    std::string_view text = opts.format_rules;
+    for (U64 line = 1; !text.empty(); line++) {
+        auto nl   = text.find('\n');
+        auto rule = Trim(std::string{text.substr(0, nl)});
+        text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+        if (rule.empty() || rule.starts_with('%')) continue;
+
+        auto Fail = [&](const std::string& msg) {
+            throw ProcessingError("Format rules:" + std::to_string(line) + ": Error: " + msg);
+        };
+
+        auto space = rule.find_first_of(" \t");
+        if (space == std::string::npos) Fail("Expected '<kind> <name>'");
+        auto kind = rule.substr(0, space);
+        auto name = Trim(rule.substr(space));
+
+        if (kind == "enumerate-env") {
+            enumerate_envs.insert(std::move(name));
+            continue;
+        }
+
+        FormatAction action;
+        if (kind == "item") action = FormatAction::Item;
+        else if (kind == "def") action = FormatAction::Def;
+        else if (kind == "linebreak") action = FormatAction::LineBreak;
+        else if (kind == "rowrule") action = FormatAction::RowRule;
+        else Fail("Unknown rule kind '" + kind + "'");
+
+        if (!name.starts_with('\\') || name.size() < 2) Fail("Expected a command sequence, got '" + name + "'");
+        user_actions[ToUTF32(name)] = action;
+    }
+}
+} // namespace TeX
@@ -0,0 +1,145 @@
+#ifndef XPP_FORMAT_RULES_H
+#define XPP_FORMAT_RULES_H
+
+#include "xpp.h"
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utils/parser.h>
+
+namespace TeX {
+/// How the formatter lays out a command sequence.
+enum struct FormatAction : U8 {
+    None,
+
+    /// Start a new line (\item).
+    Item,
+
+    /// Begin or end an environment.
+    Begin,
+    End,
+
+    /// Put the definition on separate lines if its body spans several (\def).
+    Def,
+
+    /// Conditionals (\if*, \fi).
+    If,
+    Fi,
+
+    /// Display math (\[, \]).
+    DisplayBegin,
+    DisplayEnd,
+
+    /// Break the line after this (\\).
+    LineBreak,
+
+    /// Break the line after this, but keep it on the same line as a preceding \\ (\hline).
+    RowRule,
+};
+
+namespace detail {
+struct BuiltinFormatRule {
+    std::u32string_view name;
+    FormatAction        action = FormatAction::None;
+};
+
+constexpr BuiltinFormatRule builtin_format_rules[]{
+    {U"\\item", FormatAction::Item},
+    {U"\\begin", FormatAction::Begin},
+    {U"\\end", FormatAction::End},
+    {U"\\def", FormatAction::Def},
+    {U"\\Define", FormatAction::Def},
+    {U"\\Defun", FormatAction::Def},
+    {U"\\Eval", FormatAction::Def},
+    {U"\\fi", FormatAction::Fi},
+    {U"\\[", FormatAction::DisplayBegin},
+    {U"\\]", FormatAction::DisplayEnd},
+    {U"\\\\", FormatAction::LineBreak},
+    {U"\\hline", FormatAction::RowRule},
+    {U"\\cline", FormatAction::RowRule},
+};
+
+constexpr U64 builtin_format_table_size = 32;
+
+constexpr U32 FormatRuleHash(std::u32string_view name, U32 seed) {
+    for (auto c : name) seed = (seed ^ U32(c)) * 16777619u;
+    return seed;
+}
+
+/// Find a seed for which the built-in rules don't collide.
+constexpr U32 FindFormatRuleSeed() {
+    for (U32 seed = 2166136261u;; seed++) {
+        bool used[builtin_format_table_size]{};
+        bool ok = true;
+        for (const auto& rule : builtin_format_rules) {
+            auto i = FormatRuleHash(rule.name, seed) % builtin_format_table_size;
+            if (used[i]) {
+                ok = false;
+                break;
+            }
+            used[i] = true;
+        }
+        if (ok) return seed;
+    }
+}
+
+constexpr U32 builtin_format_seed = FindFormatRuleSeed();
+
+constexpr auto builtin_format_table = [] {
+    std::array<BuiltinFormatRule, builtin_format_table_size> table{};
+    for (const auto& rule : builtin_format_rules)
+        table[FormatRuleHash(rule.name, builtin_format_seed) % builtin_format_table_size] = rule;
+    return table;
+}();
+} // namespace detail
+
+/// The rules that drive the formatter.
+///
+/// Built-in rules are looked up in a perfect hash table computed at
+/// compile time. User rules are read from Options::format_rules, one
+/// per line, in the form '<kind> <name>', where kind is one of
+///
+///   item           Start a new line before the command, like \item.
+///   def            Lay out the command like \def.
+///   linebreak      Break the line after the command, like \\.
+///   rowrule        Like \hline: keep the command on the same line as \\.
+///   enumerate-env  Indent the environment like enumerate.
+///
+/// Lines starting with '%' are comments. Built-in rules take precedence.
+class FormatRules {
+    struct StringHash {
+        using is_transparent = void;
+        auto operator()(std::string_view s) const -> std::size_t { return std::hash<std::string_view>{}(s); }
+    };
+
+    std::unordered_map<String, FormatAction>                     user_actions;
+    std::unordered_set<std::string, StringHash, std::equal_to<>> enumerate_envs;
+
+public:
+    /// Throws ProcessingError if the user rules are invalid.
+    explicit FormatRules(const Options& opts);
+
+    /// Get the action for a command sequence.
+    auto Action(const String& name) const -> FormatAction {
+        using namespace detail;
+        const auto& entry = builtin_format_table[FormatRuleHash(name, builtin_format_seed) % builtin_format_table_size];
+        if (entry.name == name) return entry.action;
+        if (!user_actions.empty()) {
+            if (auto it = user_actions.find(name); it != user_actions.end()) return it->second;
+        }
+        if (name.starts_with(U"\\if")) return FormatAction::If;
+        return FormatAction::None;
+    }
+
+    /// Check whether there are any rules other than the built-in ones.
+    bool HasUserRules() const { return !user_actions.empty(); }
+
+    /// Check whether an environment should be indented like enumerate.
+    bool IsEnumerateEnv(std::string_view name) const { return enumerate_envs.contains(name); }
+};
+} // namespace TeX
+
+#endif // XPP_FORMAT_RULES_H
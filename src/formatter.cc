@@ -1,8 +1,12 @@
 #include "parser.h"
+
+#include <functional>
 namespace TeX {
 
 /// Format Pass 1: Break the input into lines.
-auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
+auto Parser::FormatPass1(const AST& ast, U64 line_width, const FormatRules& rules) -> std::string {
+    PhaseScope  phase{Phase::FormatPass1};
+    const auto& tokens = ast.Nodes();
     struct loc {
         U64 line;
         U64 offset;
@@ -11,7 +15,9 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
     struct def {
         U64 line;
         U64 offset;
-        U64 open_braces;
+
+        /// Index of the "}" that ends the body, once we've seen the "{".
+        std::optional<U64> close;
     };
 
     /// Buffer where we're going to store the result of pass 1.
@@ -29,9 +35,9 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
     /// This serves to keep lines < line_width chars.
     U64 col{};
 
-    /// Keep track of the number of "{" and "}" after \end.
-    /// Break once it's 0.
-    U64 env_end_arg_depth{};
+    /// Index of the "}" that ends the argument of \end.
+    /// Break once we get there.
+    U64 env_end_arg_close = AST::none;
 
     /// Offset to the last space we inserted.
     /// Used to insert a line break if an element is too long.
@@ -186,7 +192,7 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                 if (tokens[tok_index].type == T::GroupBegin) {
                     col++;
                     output += '{';
-                    env_end_arg_depth++;
+                    env_end_arg_close = ast.Match(tok_index).value_or(AST::none);
                     Next(); /// Yeet "{".
                 }
                 discard = false;
@@ -208,7 +214,7 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
         }
         switch (tokens[tok_index].type) {
             case T::EndOfFile:
-            case T::Invalid: Die("Invalid token");
+            case T::Invalid: throw ProcessingError("Invalid token");
             case T::Text:
                 output += ToUTF8(tokens[tok_index].string_content);
                 col += tokens[tok_index].string_content.size();
@@ -226,20 +232,22 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                 output += arg;
             } break;
             case T::CommandSequence:
-            case T::Macro:
-                if (const auto& s = tokens[tok_index].string_content; s == U"\\item" && col != 0) {
+            case T::Macro: {
+                const auto& s      = tokens[tok_index].string_content;
+                const auto  action = rules.Action(s);
+                if (action == FormatAction::Item && col != 0) {
                     Nl();
-                } else if (s == U"\\begin") {
+                } else if (action == FormatAction::Begin) {
                     FormatEnvBegin();
                     break;
-                } else if (s == U"\\def" || s == U"\\Define" || s == U"\\Defun" || s == U"\\Eval") {
-                    def_stack.push({line, output.size(), 0});
-                } else if (s == U"\\end") {
+                } else if (action == FormatAction::Def) {
+                    def_stack.push({line, output.size(), std::nullopt});
+                } else if (action == FormatAction::End) {
                     FormatEnvEnd();
                     break;
-                } else if (s.starts_with(U"\\if"))
+                } else if (action == FormatAction::If)
                     if_stack.push({line, output.size()});
-                else if (s == U"\\fi") {
+                else if (action == FormatAction::Fi) {
                     if (!if_stack.empty()) {
                         auto [if_line, if_offset] = if_stack.top();
                         if_stack.pop();
@@ -249,9 +257,9 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                         col += 3;
                         break;
                     }
-                } else if (s == U"\\[") {
+                } else if (action == FormatAction::DisplayBegin) {
                     if (col != 0) Nl();
-                } else if (s == U"\\]") {
+                } else if (action == FormatAction::DisplayEnd) {
                     col += tokens[tok_index].string_content.size();
                     output += ToUTF8(tokens[tok_index].string_content);
                     (void) ProvideNl();
@@ -268,14 +276,11 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                     last_ws_offset = 0;
                 }
 
-                if (tokens[tok_index].string_content == U"\\\\"
-                    || tokens[tok_index].string_content == U"\\hline"
-                    || tokens[tok_index].string_content == U"\\cline") {
+                if (action == FormatAction::LineBreak || action == FormatAction::RowRule) {
                     Next();
                     if (AtEnd()) break;
                     /// Keep \hline and \cline on the same line as \\.
-                    while (tokens[tok_index].type == T::CommandSequence
-                           && (tokens[tok_index].string_content == U"\\hline" || tokens[tok_index].string_content == U"\\cline")) {
+                    while (tokens[tok_index].type == T::CommandSequence && rules.Action(tokens[tok_index].string_content) == FormatAction::RowRule) {
                         output += ToUTF8(tokens[tok_index].string_content);
                         Next();
                         if (AtEnd()) goto done;
@@ -285,6 +290,7 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                 }
             done:
                 break;
+            }
             case T::LineComment:
                 col = 0;
                 line++;
@@ -329,28 +335,25 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                 }
             } break;
             case T::GroupBegin:
-                if (env_end_arg_depth) env_end_arg_depth++;
-                if (!def_stack.empty()) {
-                    def_stack.top().open_braces++;
-                    /// Insert a line break after the "{" of a \def if the
-                    /// user provided one.
-                    if (def_stack.top().open_braces == 1) {
-                        output += "{";
-                        Next(); /// Yeet "{"
-                        if (AtEnd()) break;
-
-                        if (tokens[tok_index].type == T::Whitespace) {
-                            U64 newlines = TokenNewlines(tokens[tok_index]);
-                            if (newlines >= 1) {
-                                if (newlines > 1) output += '\n';
-                                Nl();
-                                break; /// Yeet whitespace.
-                            }
-                        }
+                /// Insert a line break after the "{" of a \def if the
+                /// user provided one.
+                if (!def_stack.empty() && !def_stack.top().close) {
+                    def_stack.top().close = ast.Match(tok_index).value_or(tokens.size());
+                    output += "{";
+                    Next(); /// Yeet "{"
+                    if (AtEnd()) break;
 
-                        discard = false;
-                        break;
+                    if (tokens[tok_index].type == T::Whitespace) {
+                        U64 newlines = TokenNewlines(tokens[tok_index]);
+                        if (newlines >= 1) {
+                            if (newlines > 1) output += '\n';
+                            Nl();
+                            break; /// Yeet whitespace.
+                        }
                     }
+
+                    discard = false;
+                    break;
                 }
                 output += "{";
                 col++;
@@ -359,26 +362,23 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
                 /// If this "}" closes a \def, insert a line before the def
                 /// as well as before and after this if the \def is not on the
                 /// same line as this.
-                if (!def_stack.empty()) {
-                    def_stack.top().open_braces--;
-                    if (!def_stack.top().open_braces) {
-                        auto [d_line, d_offset, _] = def_stack.top();
-                        def_stack.pop();
-                        if (d_line != line) {
-                            /// Insert a line break before the \def and after the "{".
-                            if (d_offset && output[d_offset - 1] != '\n') output.insert(d_offset, "\n");
-                            if (col != 0) Nl();
-                            output += '}';
-                            (void) ProvideNl();
-                            break;
-                        }
+                if (!def_stack.empty() && def_stack.top().close == tok_index) {
+                    auto [d_line, d_offset, _] = def_stack.top();
+                    def_stack.pop();
+                    if (d_line != line) {
+                        /// Insert a line break before the \def and after the "{".
+                        if (d_offset && output[d_offset - 1] != '\n') output.insert(d_offset, "\n");
+                        if (col != 0) Nl();
+                        output += '}';
+                        (void) ProvideNl();
+                        break;
                     }
                 }
                 output += "}";
                 col++;
-                if (env_end_arg_depth) {
-                    env_end_arg_depth--;
-                    if (!env_end_arg_depth) (void) ProvideNl();
+                if (env_end_arg_close == tok_index) {
+                    env_end_arg_close = AST::none;
+                    (void) ProvideNl();
                 }
                 break;
         }
@@ -390,25 +390,24 @@ auto Parser::FormatPass1(NodeList&& tokens, U64 line_width) -> std::string {
 }
 
 /// Format Pass 2: Trim whitespace and indent the lines.
-auto Parser::FormatPass2(std::string&& text, std::vector<std::string> enumerate_envs) -> std::vector<std::string> {
-    std::vector<std::string> enumerate_envs_begin;
-    std::vector<std::string> enumerate_envs_end;
-
-    for (auto& env : enumerate_envs) {
-        enumerate_envs_begin.push_back("\\begin{" + env + "}");
-        enumerate_envs_end.push_back("\\end{" + env + "}");
-    }
+/// Lines are passed to \p emit as soon as they're done; formatting stops
+/// early if it returns false.
+void Parser::FormatPass2(std::string_view text, const FormatRules& rules, const std::function<bool(std::string_view)>& emit) {
+    PhaseScope phase{Phase::FormatPass2};
+    /// Check if a line begins or ends an environment that is indented like enumerate.
+    auto IsEnumerate = [&](std::string_view line, std::string_view prefix) {
+        if (!line.starts_with(prefix)) return false;
+        auto end = line.find('}', prefix.size());
+        return end != std::string_view::npos && rules.IsEnumerateEnv(line.substr(prefix.size(), end - prefix.size()));
+    };
 
-    /// Split the input into lines.
-    std::vector<std::string> lines;
-    U64                      pos{};
-    for (;;) {
-        auto nl = text.find('\n', pos);
-        lines.push_back(text.substr(pos, nl - pos));
-        if (nl == std::string::npos) break;
-        pos = nl + 1;
-    }
-    for (auto& item : lines) item = Trim(item);
+    /// Check if a line starts with a command that the user wants to be laid out like \item.
+    auto IsUserItem = [&](std::string_view line) {
+        if (!rules.HasUserRules() || !line.starts_with('\\')) return false;
+        U64 end = 1;
+        while (end < line.size() && IsLetter(Char(line[end]))) end++;
+        return rules.Action(ToUTF32(std::string{line.substr(0, end)})) == FormatAction::Item;
+    };
 
     I64  indent_lvl{};
     auto indent_by = [&](std::string& s, I64 how_much) {
@@ -418,7 +417,14 @@ auto Parser::FormatPass2(std::string&& text, std::vector<std::string> enumerate_
     };
     auto indent = [&](std::string& s) { indent_by(s, indent_lvl); };
 
-    for (auto& item : lines) {
+    /// Used to remove consecutive empty lines.
+    bool prev_was_empty = false;
+
+    for (U64 line_start = 0; line_start <= text.size();) {
+        auto nl    = text.find('\n', line_start);
+        auto item  = Trim(std::string{text.substr(line_start, nl - line_start)});
+        line_start = nl == std::string_view::npos ? text.size() + 1 : nl + 1;
+
         /// \item is a special case.
         bool is_item = false;
 
@@ -428,30 +434,17 @@ auto Parser::FormatPass2(std::string&& text, std::vector<std::string> enumerate_
         /// \begin and \end change the indentation by 4; as do \if* and \fi.
         /// Environments that contain \item's change the indentation by 6.
         if (item.starts_with("\\begin") || item.starts_with("\\if")) {
-            bool enumerate = false;
-            for (const auto& env : enumerate_envs_begin) {
-                if (item.starts_with(env)) {
-                    enumerate = true;
-                    afterindent = 10;
-                    break;
-                }
-            }
-
-            if (!enumerate && !item.starts_with("\\begin{document}")) afterindent = 4;
+            if (IsEnumerate(item, "\\begin{")) afterindent = 10;
+            else if (!item.starts_with("\\begin{document}")) afterindent = 4;
         } else if (item.starts_with("\\end") || (item.starts_with("\\fi") && (item.size() == 3 || !std::isalpha(item[3])))) {
-            for (const auto& env : enumerate_envs_end) {
-                if (item.starts_with(env)) {
-                    indent_lvl -= 6;
-                    break;
-                }
-            }
+            if (IsEnumerate(item, "\\end{")) indent_lvl -= 6;
             if (indent_lvl < 4) indent_lvl = 0;
             else indent_lvl -= 4;
-        } else if (item.starts_with("\\item")) is_item = true;
+        } else if (item.starts_with("\\item") || IsUserItem(item)) is_item = true;
 
         /// A different number of { and } on a line changes the indentation.
         I64 lbra_cnt{}, rbra_cnt{};
-        pos = 0;
+        U64 pos = 0;
         while (pos = item.find('{', pos), pos != std::string::npos) {
             lbra_cnt++;
             pos++;
@@ -483,39 +476,59 @@ auto Parser::FormatPass2(std::string&& text, std::vector<std::string> enumerate_
             if (indent_lvl < diff) indent_lvl = 0;
             else indent_lvl -= diff;
         } else if (lbra_cnt > rbra_cnt) indent_lvl += (lbra_cnt - rbra_cnt) * 4;
-    }
 
-    /// Remove consecutive empty lines.
-    std::vector<I64> empty_lines;
-    bool             prev_was_empty = false;
-    for (U64 i = 0; i < lines.size(); i++) {
-        if (lines[i].empty()) {
-            if (prev_was_empty) empty_lines.push_back(I64(i));
-            else prev_was_empty = true;
+        /// Remove consecutive empty lines.
+        if (item.empty()) {
+            if (prev_was_empty) continue;
+            prev_was_empty = true;
         } else prev_was_empty = false;
-    }
-    for (auto it = empty_lines.rbegin(); it != empty_lines.rend(); ++it)
-        lines.erase(lines.begin() + *it);
 
-    return lines;
+        if (!emit(item)) return;
+    }
 }
 
-void Parser::Format() {
+void Parser::FormatLines(const std::function<bool(std::string_view)>& emit) {
     /// Split the text into tokens and merge text nodes.
-    while (token.type != T::EndOfFile) {
-        tokens.push_back(token);
-        NextToken();
+    {
+        PhaseScope phase{Phase::Parse};
+        Start();
+        while (token.type != T::EndOfFile) {
+            tokens.push_back(token);
+            NextToken();
+        }
     }
+    ThrowIfError();
+    FormatTokens(std::move(tokens), opts, format_rules, emit);
+}
+
+void Parser::FormatTokens(NodeList tokens, const Options& opts, const FormatRules* format_rules, const std::function<bool(std::string_view)>& emit) {
     MergeTextNodes(tokens, false);
 
-    /// List of environments that should be indented like enumerate.
-    std::vector<std::string> enumerate_envs = {"enumerate", "itemize"};
-    if (auto envs = options::get<"--enumerate-env">()) {
-        enumerate_envs.insert(enumerate_envs.end(), envs->begin(), envs->end());
-    }
+    /// Compile the rules unless we've been given compiled ones.
+    std::optional<FormatRules> own_rules;
+    const auto&                rules = format_rules ? *format_rules : own_rules.emplace(opts);
+    FormatPass2(FormatPass1(AST{std::move(tokens)}, opts.line_width, rules), rules, emit);
+}
 
-    for (auto& item : FormatPass2(FormatPass1(std::move(tokens), line_width), std::move(enumerate_envs)))
-        fprintf(output_file, "%s\n", item.c_str());
+auto Parser::Format() -> std::string {
+    std::string out;
+    FormatLines([&](std::string_view line) {
+        out += line;
+        out += '\n';
+        return true;
+    });
+    return out;
 }
 
+auto Parser::CheckFormat(std::string_view input) -> bool {
+    /// Compare each line against the input as soon as it's been formatted.
+    U64  pos     = 0;
+    bool matches = true;
+    FormatLines([&](std::string_view line) {
+        matches = input.substr(pos, line.size()) == line && pos + line.size() < input.size() && input[pos + line.size()] == '\n';
+        pos += line.size() + 1;
+        return matches;
+    });
+    return matches && pos == input.size();
+}
 } // namespace TeX
\ No newline at end of file
@@ -0,0 +1,102 @@
+#ifndef XPP_HASH_H
+#define XPP_HASH_H
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace TeX {
+/// XXH64 hash of a buffer.
+inline std::uint64_t XXH64(std::string_view data, std::uint64_t seed = 0) {
+    static constexpr std::uint64_t P1 = 11400714785074694791ULL;
+    static constexpr std::uint64_t P2 = 14029467366897019727ULL;
+    static constexpr std::uint64_t P3 = 1609587929392839161ULL;
+    static constexpr std::uint64_t P4 = 9650029242287828579ULL;
+    static constexpr std::uint64_t P5 = 2870177450012600261ULL;
+
+    auto Read64 = [](const char* p) {
+        std::uint64_t v;
+        std::memcpy(&v, p, sizeof v);
+        return v;
+    };
+
+    auto Read32 = [](const char* p) {
+        std::uint32_t v;
+        std::memcpy(&v, p, sizeof v);
+        return v;
+    };
+
+    auto Round = [](std::uint64_t acc, std::uint64_t input) {
+        acc += input * P2;
+        acc = std::rotl(acc, 31);
+        return acc * P1;
+    };
+
+    auto Merge = [&](std::uint64_t acc, std::uint64_t val) {
+        acc ^= Round(0, val);
+        return acc * P1 + P4;
+    };
+
+    const char* p   = data.data();
+    const char* end = p + data.size();
+    std::uint64_t h;
+
+    if (data.size() >= 32) {
+        std::uint64_t v1 = seed + P1 + P2;
+        std::uint64_t v2 = seed + P2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+        }
+
+        h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+        h = Merge(h, v1);
+        h = Merge(h, v2);
+        h = Merge(h, v3);
+        h = Merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+
+    h += data.size();
+    for (; end - p >= 8; p += 8) {
+        h ^= Round(0, Read64(p));
+        h = std::rotl(h, 27) * P1 + P4;
+    }
+
+    if (end - p >= 4) {
+        h ^= std::uint64_t(Read32(p)) * P1;
+        h = std::rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+
+    for (; p != end; p++) {
+        h ^= std::uint64_t(std::uint8_t(*p)) * P5;
+        h = std::rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// 128-bit hash of a buffer as a hex string.
+inline std::string HashHex(std::string_view data) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string           hex;
+    for (std::uint64_t h : {XXH64(data, 0), XXH64(data, 1)})
+        for (int i = 60; i >= 0; i -= 4) hex += digits[(h >> i) & 0xF];
+    return hex;
+}
+} // namespace TeX
+
+#endif // XPP_HASH_H
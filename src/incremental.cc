@@ -0,0 +1,150 @@
+#include "parser.h"
+
+namespace TeX {
+namespace fs = std::filesystem;
+
+auto NormalisePath(const std::string& path) -> fs::path {
+    return fs::absolute(path).lexically_normal();
+}
+
+void WatchSession::ResumePoint(const std::set<fs::path>& changed) {
+    resume.reset();
+
+    /// If the last run stopped early, or the main file changed, we have to start over.
+    if (!state || dependencies.empty() || changed.contains(NormalisePath(dependencies[0]))) return;
+
+    /// Everything before the first time a changed file was
+    /// included is unaffected by the change.
+    U64 first = 0;
+    while (first < includes.size() && !changed.contains(NormalisePath(includes[first]))) first++;
+    if (first == includes.size()) return;
+
+    /// Find the last snapshot taken at or before that point.
+    for (U64 i = snapshots.size(); i; i--) {
+        if (snapshots[i - 1].include_index <= first) {
+            resume = i - 1;
+            return;
+        }
+    }
+}
+
+bool IncludeGuard::AddPath(const fs::path& path) {
+    if (!paths.insert(path).second) return false;
+    path_order.push_back(path);
+    return true;
+}
+
+bool IncludeGuard::AddHash(U64 hash) {
+    if (!hashes.insert(hash).second) return false;
+    hash_order.push_back(hash);
+    return true;
+}
+
+void IncludeGuard::Rewind(U64 path_count, U64 hash_count) {
+    for (; path_order.size() > path_count; path_order.pop_back()) paths.erase(path_order.back());
+    for (; hash_order.size() > hash_count; hash_order.pop_back()) hashes.erase(hash_order.back());
+}
+
+Parser::~Parser() {
+    if (!watch || !parsed) return;
+    watch->state = WatchSession::State{
+        .sources       = std::move(sources),
+        .macros        = std::move(macros),
+        .rep_rules     = std::move(rep_rules),
+        .raw_rep_rules = std::move(raw_rep_rules),
+        .regex_rules   = std::move(regex_rules),
+        .include_guard = std::move(include_guard),
+    };
+}
+
+void Parser::RecordInclude(const std::string& path) {
+    /// We can only resume parsing at the top level, and the macro
+    /// table can only be rewound to a point outside of any group.
+    if (parse_depth == 0 && group_count == 0) {
+        std::vector<std::pair<U32, U32>> files;
+        for (const auto& f : open_files) files.emplace_back(f.file, f.offset);
+        watch->snapshots.push_back({
+            .include_index       = watch->includes.size(),
+            .token_count         = tokens.size(),
+            .dependency_count    = dependencies.size(),
+            .source_count        = sources.Count(),
+            .macro_checkpoint    = macros.Checkpoint(),
+            .rule_count          = rep_rules.rules.size(),
+            .raw_rule_count      = raw_rep_rules.processed.size(),
+            .regex_rule_count    = regex_rules.size(),
+            .included_path_count = include_guard.path_order.size(),
+            .included_hash_count = include_guard.hash_order.size(),
+            .open_files          = std::move(files),
+            .lastc               = lastc,
+            .at_eof              = at_eof,
+            .conditionals        = conditionals,
+            .lookahead_queue     = lookahead_queue,
+            .token               = token,
+        });
+    }
+    watch->includes.push_back(path);
+}
+
+void Parser::ResumeFrom(U64 index) {
+    auto& includes  = watch->includes;
+    auto& snapshots = watch->snapshots;
+    auto  snapshot  = std::move(snapshots[index]);
+    auto  state     = std::move(*watch->state);
+    watch->state.reset();
+
+    /// Rewind the state at the end of the last run to the snapshot. The
+    /// main file and the files included before the snapshot haven't changed,
+    /// so this puts the parser in the same state that it was in when the
+    /// snapshot was taken without lexing or parsing anything again.
+    sources       = std::move(state.sources);
+    macros        = std::move(state.macros);
+    rep_rules     = std::move(state.rep_rules);
+    raw_rep_rules = std::move(state.raw_rep_rules);
+    regex_rules   = std::move(state.regex_rules);
+    include_guard = std::move(state.include_guard);
+    sources.Truncate(snapshot.source_count);
+    macros.Rewind(snapshot.macro_checkpoint);
+    rep_rules.rules.resize(snapshot.rule_count);
+    rep_rules.processed.clear();
+    raw_rep_rules.processed.resize(snapshot.raw_rule_count);
+    regex_rules.Truncate(snapshot.regex_rule_count);
+    include_guard.Rewind(snapshot.included_path_count, snapshot.included_hash_count);
+
+    /// Seek to where the lexer was. The main file has already been read;
+    /// any other file that was open needs to be read again.
+    open_files[0].offset = snapshot.open_files[0].second;
+    for (U64 i = 1; i < snapshot.open_files.size(); i++) {
+        auto [file, offset] = snapshot.open_files[i];
+        const auto& path    = sources.Path(file);
+        auto        bytes   = ReadInput(path);
+        if (!bytes) throw ProcessingError("Could not open " + path + ": " + strerror(errno));
+
+        String text;
+        DecodeUTF8(*bytes, text);
+        open_files.push_back({file, offset, U32(text.size()), std::move(text)});
+    }
+    lastc  = snapshot.lastc;
+    at_eof = snapshot.at_eof;
+
+    /// Restore the rest of the parser state.
+    tokens = std::move(watch->tokens);
+    tokens.erase(tokens.begin() + I64(snapshot.token_count), tokens.end());
+    dependencies.assign(watch->dependencies.begin(), watch->dependencies.begin() + I64(snapshot.dependency_count));
+    conditionals    = std::move(snapshot.conditionals);
+    lookahead_queue = std::move(snapshot.lookahead_queue);
+    token           = std::move(snapshot.token);
+
+    /// Everything from here on is parsed again.
+    auto path = includes[snapshot.include_index];
+    includes.erase(includes.begin() + I64(snapshot.include_index), includes.end());
+    snapshots.erase(snapshots.begin() + I64(index), snapshots.end());
+
+    /// Pick up where HandleInclude() left off; Parse() continues
+    /// with the first token of the included file.
+    RecordInclude(path);
+    if (auto contents = ReadInput(path)) IncludeFile(path, *contents);
+    else Error(token.loc, "Could not open file '%s': %s", path.c_str(), strerror(errno));
+    dependencies.push_back(std::move(path));
+    NextToken();
+}
+} // namespace TeX
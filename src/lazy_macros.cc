@@ -0,0 +1,136 @@
+#include "parser.h"
+
+#include <algorithm>
+
+namespace TeX {
+/// Read the body of a \Define. Libraries define far more macros than a
+/// document uses, so if nothing in the body needs to be processed when
+/// the macro is defined, i.e. it uses no directives and no macros, we
+/// only find the matching brace and save the text in between; it is
+/// lexed by Replacement() when the macro is first expanded. Otherwise,
+/// the text up to the first directive or macro is lexed and the rest of
+/// the body is parsed as ParseGroup() would.
+void Parser::ParseDefinitionBody(Macro& macro) {
+    /// The text of the body can only be read if it's what the lexer reads
+    /// next. The profiler expects every token of the input to be lexed.
+    auto here = Here();
+    if (token.type != TokenType::GroupBegin || !lookahead_queue.empty() || replay || profiler || at_eof
+        || token.loc.file != here.file || token.loc.offset + 1 != here.offset) {
+        macro.replacement = ParseGroup();
+        return;
+    }
+
+    SkipCharsUntilIfWhitespace('{');
+    here = Here();
+
+    String text;
+    U64    depth = 0;
+    while (!at_eof && (lastc != U'}' || depth)) {
+        switch (lastc) {
+            case U'{': depth++; break;
+            case U'}': depth--; break;
+
+            /// Braces in a comment don't count.
+            case U'%':
+                while (!at_eof && lastc != U'\n') {
+                    text += lastc;
+                    NextChar();
+                }
+                continue;
+
+            case U'\\': {
+                Token cs;
+                cs.type           = TokenType::CommandSequence;
+                cs.loc            = Here();
+                cs.string_content = lastc;
+                NextChar();
+                if (at_eof) continue;
+                if (!IsLetter(lastc)) {
+                    text += cs.string_content;
+                    break;
+                }
+
+                do {
+                    cs.string_content += lastc;
+                    NextChar();
+                } while (IsLetter(lastc));
+
+                /// Directives may read the input that follows them, so
+                /// stop here and process the rest of the body as usual.
+                if (IsDirective(ToUTF8(cs.string_content.substr(1))) || macros.Contains(cs.string_content)) {
+                    for (const auto& node : LexMacroSource(text, here)) PushLookahead(node);
+                    PushLookahead(cs);
+                    macro.replacement = ParseGroupContents(here, false);
+                    return;
+                }
+                text += cs.string_content;
+                continue;
+            }
+
+            /// Report invalid macro arguments here since the body
+            /// may never be lexed.
+            case U'#':
+                text += lastc;
+                NextChar();
+                if (!at_eof && lastc == U'#') {
+                    text += lastc;
+                    NextChar();
+                }
+                if (!at_eof && ToDecimal(lastc) < 1) Error(Here(), "Expected number after # to be between 1 and 9");
+                continue;
+
+            default: break;
+        }
+        text += lastc;
+        NextChar();
+    }
+
+    if (at_eof) {
+        Error(here, "Group terminated by end of file");
+        NextToken();
+        return;
+    }
+
+    macro.source     = std::move(text);
+    macro.source_loc = here;
+    NextToken(); /// lex '}'
+    NextToken(); /// yeet '}'
+}
+
+/// Lex the text of a macro body that starts at \p loc. Comments
+/// are dropped, since ParseGroup() drops them as well.
+auto Parser::LexMacroSource(const String& text, Location loc) -> NodeList {
+    NodeList lst;
+    Parser   p{opts, text, 0};
+    p.NextChar();
+    for (p.NextToken(); p.token.type != TokenType::EndOfFile; p.NextToken()) {
+        if (p.token.type == TokenType::LineComment) continue;
+        p.token.loc = {loc.file, loc.offset + p.token.loc.offset - 1};
+        lst.push_back(std::move(p.token));
+    }
+    return lst;
+}
+
+auto Parser::Replacement(Macro& macro) -> const NodeList& {
+    if (macro.source) {
+        macro.replacement = LexMacroSource(*macro.source, macro.source_loc);
+        macro.source.reset();
+    }
+    return macro.replacement;
+}
+
+auto Parser::UnusedMacros() -> std::vector<std::string> {
+    std::vector<std::pair<Location, const String*>> unused;
+    macros.ForEach([&](const String& name, Macro& m) {
+        if (!m.used) unused.emplace_back(m.loc, &name);
+    });
+
+    std::sort(unused.begin(), unused.end(), [](const auto& a, const auto& b) {
+        return std::pair{a.first.file, a.first.offset} < std::pair{b.first.file, b.first.offset};
+    });
+
+    std::vector<std::string> notes;
+    for (const auto& [loc, name] : unused) notes.push_back(sources.Print(loc) + ": Note: " + ToUTF8(*name) + " is never used");
+    return notes;
+}
+} // namespace TeX
@@ -0,0 +1,82 @@
+#include "parser.h"
+
+namespace TeX {
+auto MacroTable::Find(const String& name) -> Macro* {
+    auto it = table.find(name);
+    return it == table.end() ? nullptr : &it->second.macro;
+}
+
+auto MacroTable::Use(const String& name) -> Macro* {
+    auto it = table.find(name);
+    if (it == table.end()) return nullptr;
+    if (keep_history && !it->second.macro.used) history.push_back({name, std::nullopt, true});
+    it->second.macro.used = true;
+    return &it->second.macro;
+}
+
+/// Set the entry of a macro, or remove it if \p entry is empty.
+void MacroTable::Replace(const String& name, std::optional<Entry> entry) {
+    auto it = table.find(name);
+    if (keep_history) {
+        if (it == table.end()) history.push_back({name, std::nullopt});
+        else history.push_back({name, std::move(it->second)});
+    }
+
+    if (!entry) {
+        if (it != table.end()) table.erase(it);
+    } else if (it == table.end()) {
+        table.emplace(name, std::move(*entry));
+    } else {
+        it->second = std::move(*entry);
+    }
+}
+
+/// Save the current definition of a macro, if any, unless it has already
+/// been saved in this group. Nothing needs saving outside of a group.
+void MacroTable::Save(const String& name) {
+    if (groups.empty()) return;
+    auto it = table.find(name);
+    if (it == table.end()) undo_log.push_back({name, std::nullopt});
+    else if (it->second.saved_at != groups.size()) undo_log.push_back({name, it->second});
+}
+
+void MacroTable::Define(const String& name, Macro macro) {
+    Save(name);
+    Replace(name, Entry{std::move(macro), groups.size()});
+}
+
+void MacroTable::Undefine(const String& name) {
+    auto it = table.find(name);
+    if (it == table.end()) return;
+    Save(name);
+    Replace(name, std::nullopt);
+}
+
+void MacroTable::LeaveGroup() {
+    if (groups.empty()) return;
+    auto start = groups.back();
+    groups.pop_back();
+
+    /// Restore definitions in reverse order, in case a macro was
+    /// saved more than once after being undefined and redefined.
+    while (undo_log.size() > start) {
+        auto& [name, entry] = undo_log.back();
+        Replace(name, std::move(entry));
+        undo_log.pop_back();
+    }
+}
+
+void MacroTable::Rewind(U64 checkpoint) {
+    while (history.size() > checkpoint) {
+        auto& [name, entry, used] = history.back();
+        if (used) table.find(name)->second.macro.used = false;
+        else if (entry) table.insert_or_assign(std::move(name), std::move(*entry));
+        else table.erase(name);
+        history.pop_back();
+    }
+
+    /// There were no open groups at the checkpoint.
+    undo_log.clear();
+    groups.clear();
+}
+} // namespace TeX
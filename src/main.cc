@@ -1,9 +1,122 @@
-#include "parser.h"
+#include "cli.h"
 
 #include <clocale>
+#include <iostream>
+
+namespace TeX::cli {
+auto MakeOptions() -> Options {
+    Options opts;
+    if (auto lw = options::get<"--line-width">()) opts.line_width = *lw < 20 ? 100 : U64(*lw);
+    if (auto envs = options::get<"--enumerate-env">()) opts.enumerate_envs = *envs;
+    if (auto path = options::get<"--format-rules">()) {
+        auto rules = ReadFile(*path);
+        if (!rules) Die("Could not read format rules from %s", path->c_str());
+        opts.format_rules = std::move(*rules);
+    }
+    opts.pipeline          = options::get<"--pipeline">();
+    opts.prefetch_includes = options::get<"--prefetch-includes">();
+    opts.parallel_lexing   = options::get<"--parallel-lex">();
+    opts.parallel_emit     = options::get<"--parallel-emit">();
+    return opts;
+}
+
+int Run() {
+    const auto opts = MakeOptions();
+    if (options::get<"--diff">() && !options::get<"--check">()) Die("--diff requires --check");
+    if (options::get<"--binary">() && !options::get<"--print-tokens">()) Die("--binary requires --print-tokens");
+    if (options::get<"--check">()) return Check(opts);
+
+    const auto* files = options::get<"file">();
+    if (!files || files->size() != 1) Die("Expected exactly one input file");
+    const auto& file = files->front();
+    auto        out  = options::get<"-o">();
+    if ((options::get<"-MD">() || options::get<"-MF">()) && !out) Die("-MD and -MF require an output file (-o)");
+    if (options::get<"--only-if-changed">() && !out) Die("--only-if-changed requires an output file (-o)");
+    if (ChunkedReader::IsStream(file) && (options::get<"--watch">() || options::get<"--cache-dir">()))
+        Die("--watch and --cache-dir can't be used when reading from stdin or a pipe");
+    if (options::get<"--profile-macros">()) {
+        if (options::get<"--format">() || options::get<"--print-tokens">() || options::get<"--wc">())
+            Die("--profile-macros can only be used when preprocessing");
+        if (options::get<"--watch">() || opts.pipeline) Die("--profile-macros can't be used with --watch or --pipeline");
+    }
+    if (options::get<"--unused-macros">()) {
+        if (options::get<"--format">() || options::get<"--print-tokens">() || options::get<"--wc">())
+            Die("--unused-macros can only be used when preprocessing");
+        if (options::get<"--watch">()) Die("--unused-macros can't be used with --watch");
+    }
+    if (options::get<"--emit-preprocessed">() || options::get<"--emit-formatted">() || options::get<"--emit-wc">()) {
+        if (out || options::get<"--format">() || options::get<"--wc">() || options::get<"--print-tokens">()
+            || options::get<"--watch">() || options::get<"--cache-dir">() || options::get<"--profile-macros">()
+            || options::get<"--unused-macros">())
+            Die("--emit-* can't be combined with -o, --format, --wc, --print-tokens, --watch, --cache-dir, --profile-macros or --unused-macros");
+        if (ChunkedReader::IsStream(file) || TokenDump::IsTokenDump(file)) Die("--emit-* can only be used with a .tex file");
+        return EmitAll(file, opts);
+    }
+    if (options::get<"--watch">()) Watch(file, opts);
+
+    /// --wc prints to stdout directly.
+    if (options::get<"--wc">()) {
+        auto wc = Parser{file, opts}.CountWords();
+        std::cout << "Number of characters: " << wc.chars << "\n";
+        std::cout << "Number of words:      " << wc.words << "\n";
+        return 0;
+    }
+
+    /// Files without directives are copied to the output unchanged.
+    if (!options::get<"--format">() && !options::get<"--print-tokens">() && !options::get<"--profile-macros">()
+        && !ChunkedReader::IsStream(file) && PassThrough(file)) return 0;
+
+    /// Check if we have a cached result.
+    std::unique_ptr<OutputCache> cache;
+    if (auto dir = options::get<"--cache-dir">(); dir && !options::get<"--profile-macros">() && !options::get<"--unused-macros">()) {
+        std::string key = options::get<"--format">()       ? "format"
+                          : options::get<"--print-tokens">() ? "print-tokens"
+                                                             : "preprocess";
+        key += '\0' + std::to_string(opts.line_width);
+        for (const auto& env : opts.enumerate_envs) key += '\0' + env;
+        key += '\0' + opts.format_rules;
+        if (options::get<"--binary">()) key += std::string_view{"\0binary", 7};
+
+        /// Tokens are printed with the path of the file they're from.
+        if (options::get<"--print-tokens">()) key += '\0' + file;
+
+        std::vector<std::string> dependencies{file};
+        auto                     size = options::get<"--cache-size">();
+        cache                         = std::make_unique<OutputCache>(*dir, size && *size > 0 ? U64(*size) << 20 : U64(1) << 30, file, key);
+        if (auto result = cache->Lookup(dependencies); result && CopyToOutput(*result, dependencies)) return 0;
+    }
+
+    Parser                         p{file, opts};
+    std::unique_ptr<MacroProfiler> profiler;
+    if (options::get<"--profile-macros">()) {
+        profiler   = std::make_unique<MacroProfiler>();
+        p.profiler = profiler.get();
+    }
+
+    std::string text = options::get<"--print-tokens">() ? (options::get<"--binary">() ? p.DumpTokens() : p.PrintTokens())
+                       : options::get<"--format">()     ? p.Format()
+                                                        : p.Preprocess();
+    if (cache) cache->Store(text, std::span{p.dependencies}.subspan(1));
+    WriteOutput(text, p.dependencies);
+    if (profiler) WriteProfile(*profiler, *options::get<"--profile-macros">());
+    if (options::get<"--unused-macros">())
+        for (const auto& note : p.UnusedMacros()) std::cerr << note << "\n";
+    return 0;
+}
+} // namespace TeX::cli
 
 int main(int argc, char** argv) {
     setlocale(LC_ALL, "");
-    TeX::Parser::options::parse(argc, argv);
-    TeX::Parser p{};
+    TeX::cli::options::parse(argc, argv);
+
+    int status;
+    try {
+        status = TeX::cli::Run();
+    } catch (const TeX::ProcessingError& e) {
+        std::cerr << e.what() << "\n";
+        status = 1;
+    }
+
+    if (TeX::cli::options::get<"--stats">()) TeX::cli::PrintStats();
+    return status;
 }
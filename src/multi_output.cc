@@ -0,0 +1,67 @@
+#include "parser.h"
+
+#include <thread>
+
+namespace TeX {
+auto Parser::ProcessAll(const std::string& path, const Options& opts, bool preprocess, bool format, bool count_words) -> RunOutputs {
+    /// Decode and lex the file once; this uses several threads if there are any.
+    Parser lexer{path, opts, InputKind::Parallel};
+    {
+        PhaseScope phase{Phase::Parse};
+        lexer.Start();
+        lexer.tokens.reserve(lexer.speculative->EstimateTokens(lexer.speculative->text.size()));
+        while (lexer.token.type != T::EndOfFile) {
+            lexer.tokens.push_back(std::move(lexer.token));
+            lexer.NextToken();
+        }
+    }
+    lexer.ThrowIfError();
+
+    const auto& text = lexer.speculative->text;
+    RunOutputs  outputs;
+    if (count_words) {
+        WordCount wc{.words = 1};
+        for (const auto& token : lexer.tokens) CountToken(wc, token);
+        outputs.word_count = wc;
+    }
+
+    /// The back ends modify the tokens, so the preprocessor gets a copy and
+    /// the formatter gets the original.
+    std::optional<Parser> preprocessor;
+    if (preprocess) preprocessor.emplace(path, opts, text, format ? lexer.tokens : std::move(lexer.tokens));
+
+    std::exception_ptr errors[2];
+    {
+        std::vector<std::jthread> backends;
+        if (preprocess) {
+            backends.emplace_back([&] {
+                try {
+                    outputs.preprocessed = preprocessor->Preprocess();
+                } catch (...) {
+                    errors[0] = std::current_exception();
+                }
+            });
+        }
+
+        if (format) {
+            backends.emplace_back([&] {
+                try {
+                    std::string out;
+                    FormatTokens(std::move(lexer.tokens), opts, nullptr, [&](std::string_view line) {
+                        out += line;
+                        out += '\n';
+                        return true;
+                    });
+                    outputs.formatted = std::move(out);
+                } catch (...) {
+                    errors[1] = std::current_exception();
+                }
+            });
+        }
+    }
+
+    for (const auto& e : errors)
+        if (e) std::rethrow_exception(e);
+    return outputs;
+}
+} // namespace TeX
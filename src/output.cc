@@ -0,0 +1,241 @@
+#include "cli.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/fs.h>
+#include <set>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TeX::cli {
+/// For --stats: the size of the input if it was checked for directives,
+/// and how much of it was scanned before one was found.
+std::optional<U64> passthrough_size;
+U64                passthrough_scanned = 0;
+
+/// Escape a file name for use in a Makefile rule.
+std::string MakeEscape(std::string_view name) {
+    std::string escaped;
+    for (auto c : name) {
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '#':
+                escaped += '\\';
+                break;
+            case '$':
+                escaped += '$';
+                break;
+            default: break;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+/// Copy the rest of a file to a file descriptor, cloning it if possible.
+bool CopyFileTo(int from, int to) {
+    /// Try to reflink the file; this is basically free on CoW file systems.
+    if (ioctl(to, FICLONE, from) == 0) return true;
+
+    /// Otherwise, let the kernel copy it; copy_file_range() doesn't support
+    /// pipes, but sendfile() does. Fall back to copying it ourselves if
+    /// neither is supported.
+    ssize_t n;
+    while ((n = copy_file_range(from, nullptr, to, nullptr, 1 << 30, 0)) > 0);
+    if (n < 0) while ((n = sendfile(to, from, nullptr, 1 << 30)) > 0);
+    if (n < 0) {
+        char buffer[1 << 16];
+        while ((n = read(from, buffer, sizeof buffer)) > 0)
+            if (write(to, buffer, size_t(n)) != n) n = -1;
+    }
+    return n == 0;
+}
+
+/// Read the rest of a file.
+auto ReadAll(int fd) -> std::optional<std::string> {
+    std::string contents;
+    char        buffer[1 << 16];
+    ssize_t     n;
+    while ((n = read(fd, buffer, sizeof buffer)) > 0) contents.append(buffer, size_t(n));
+    if (n < 0) return std::nullopt;
+    return contents;
+}
+
+void WriteDependencies(const std::vector<std::string>& dependencies) {
+    std::string dep_file;
+    if (auto mf = options::get<"-MF">()) dep_file = *mf;
+    else if (options::get<"-MD">()) dep_file = *options::get<"-o">() + ".d";
+    else return;
+
+    std::string rule = MakeEscape(*options::get<"-o">()) + ":";
+    std::set<std::string_view> seen;
+    for (const auto& dep : dependencies) {
+        if (dep == "-" || !seen.insert(dep).second) continue;
+        rule += " \\\n  ";
+        rule += MakeEscape(dep);
+    }
+    rule += "\n";
+
+    auto file = fopen(dep_file.c_str(), "w");
+    if (!file) Die("Could not open dependency file: %s", strerror(errno));
+    fwrite(rule.data(), 1, rule.size(), file);
+    fclose(file);
+}
+
+/// Returns false if the result can't be read; the output file
+/// may have been truncated by then, but nothing else was written.
+bool CopyResult(const std::filesystem::path& result) {
+    /// Keep the result open throughout so that it can't be
+    /// evicted from the cache while we're copying it.
+    int fd = open(result.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    auto out = options::get<"-o">();
+    if (!out) {
+        bool copied = CopyFileTo(fd, STDOUT_FILENO);
+        close(fd);
+        if (!copied) Die("Could not copy output: %s", strerror(errno));
+        return true;
+    }
+
+    /// The file is uncompressed, so it can't be copied to a compressed file.
+    if (CompressionForPath(*out) != Compression::None) {
+        auto text = ReadAll(fd);
+        close(fd);
+        if (!text) return false;
+        if (options::get<"--only-if-changed">() && ReadFile(*out) == text) return true;
+        WriteFile(*out, *text);
+        return true;
+    }
+
+    /// Don't touch the file if its contents are the same.
+    if (options::get<"--only-if-changed">()) {
+        std::ifstream     a{*out, std::ios::binary};
+        std::stringstream old_contents;
+        old_contents << a.rdbuf();
+        auto new_contents = ReadAll(fd);
+        if (!new_contents || lseek(fd, 0, SEEK_SET) != 0) {
+            close(fd);
+            return false;
+        }
+        if (a && old_contents.view() == *new_contents) {
+            close(fd);
+            return true;
+        }
+    }
+
+    int to = open(out->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (to < 0) Die("Could not write output file: %s", strerror(errno));
+    bool copied = CopyFileTo(fd, to);
+    close(fd);
+    close(to);
+    return copied;
+}
+
+/// The dependency file is written last so it never refers
+/// to an output file that couldn't be written.
+bool CopyToOutput(const std::filesystem::path& result, const std::vector<std::string>& dependencies) {
+    if (!CopyResult(result)) return false;
+    WriteDependencies(dependencies);
+    return true;
+}
+
+bool PassThrough(const std::string& file) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        auto size = U64(st.st_size);
+        if (size == 0) passthrough_size = 0;
+        else if (auto m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0); m != MAP_FAILED) {
+            passthrough_size    = size;
+            passthrough_scanned = Parser::PassThroughPrefix({static_cast<const char*>(m), size});
+            munmap(m, size);
+        }
+    }
+    close(fd);
+    if (!passthrough_size || passthrough_scanned != *passthrough_size) return false;
+
+    /// Don't truncate the input if it's also the output.
+    std::error_code ec;
+    if (auto out = options::get<"-o">(); out && std::filesystem::equivalent(file, *out, ec)) WriteDependencies({file});
+    else return CopyToOutput(file, {file});
+    return true;
+}
+
+void PrintStats() {
+    if (!passthrough_size) std::fprintf(stderr, "Input not checked for directives\n");
+    else if (passthrough_scanned == *passthrough_size) std::fprintf(stderr, "Input copied unchanged: no directives in %zu bytes\n", *passthrough_size);
+    else std::fprintf(stderr, "Input preprocessed: stopped scanning for directives after %zu of %zu bytes\n", passthrough_scanned, *passthrough_size);
+}
+
+void WriteText(std::string_view text) {
+    auto out = options::get<"-o">();
+    if (!out) {
+        fwrite(text.data(), 1, text.size(), stdout);
+        fflush(stdout);
+        return;
+    }
+
+    /// Don't touch the file if its contents are the same.
+    if (options::get<"--only-if-changed">()) {
+        if (auto old = ReadFile(*out); old && *old == text) return;
+    }
+
+    WriteFile(*out, text);
+}
+
+void WriteOutput(std::string_view text, const std::vector<std::string>& dependencies) {
+    WriteText(text);
+    WriteDependencies(dependencies);
+}
+
+void WriteFile(const std::string& path, std::string_view contents) {
+    auto compressor = Compressor::Create(CompressionForPath(path));
+    auto file       = fopen(path.c_str(), "w");
+    if (!file) Die("Could not open %s: %s", path.c_str(), strerror(errno));
+
+    /// Compress the contents a piece at a time so we never
+    /// hold all of the compressed data in memory.
+    if (compressor) {
+        constexpr U64 piece_size = 1 << 20;
+        std::string   compressed;
+        for (U64 pos = 0;; pos += piece_size) {
+            compressed.clear();
+            if (pos < contents.size()) compressor->Compress(contents.substr(pos, piece_size), compressed);
+            else compressor->Finish(compressed);
+            fwrite(compressed.data(), 1, compressed.size(), file);
+            if (pos >= contents.size()) break;
+        }
+    } else {
+        fwrite(contents.data(), 1, contents.size(), file);
+    }
+    fclose(file);
+}
+
+void WriteProfile(const MacroProfiler& profiler, const std::string& path) {
+    WriteFile(path, profiler.Report());
+    WriteFile(path + ".folded", profiler.FoldedStacks());
+}
+
+int EmitAll(const std::string& file, const Options& opts) {
+    auto preprocessed = options::get<"--emit-preprocessed">();
+    auto formatted    = options::get<"--emit-formatted">();
+    auto wc           = options::get<"--emit-wc">();
+    auto outputs      = Parser::ProcessAll(file, opts, preprocessed != nullptr, formatted != nullptr, wc != nullptr);
+    if (preprocessed) WriteFile(*preprocessed, *outputs.preprocessed);
+    if (formatted) WriteFile(*formatted, *outputs.formatted);
+    if (wc) {
+        WriteFile(*wc, "{\"characters\": " + std::to_string(outputs.word_count->chars)
+                       + ", \"words\": " + std::to_string(outputs.word_count->words) + "}\n");
+    }
+    return 0;
+}
+} // namespace TeX::cli
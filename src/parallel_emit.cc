@@ -0,0 +1,161 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace TeX {
+namespace {
+/// Documents with fewer tokens than this are emitted on one thread.
+constexpr U64 parallel_emit_min_tokens = 64 * 1024;
+
+/// Number of ranges per thread; more ranges than threads
+/// even out differences in how much text there is in each.
+constexpr U64 parallel_emit_ranges_per_thread = 4;
+
+/// Call \p f for every integer in [0, count) on all available threads.
+template <typename Callable>
+void ParallelFor(U64 count, U64 threads, Callable f) {
+    std::atomic<U64> next = 0;
+    auto             Work = [&] {
+        PhaseScope phase{Phase::Emit};
+        for (U64 i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) f(i);
+    };
+
+    std::vector<std::jthread> workers;
+    for (U64 i = 1; i < std::min(threads, count); i++) workers.emplace_back(Work);
+    Work();
+}
+
+/// Replace the sizes in \p sizes with the offsets at which each range
+/// starts, and return the total size.
+auto PrefixSum(std::vector<U64>& sizes) -> U64 {
+    U64 total = 0;
+    for (auto& s : sizes) total += std::exchange(s, total);
+    return total;
+}
+
+auto UTF8Size(Char c) -> U64 {
+    return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+auto UTF8Size(std::u32string_view s) -> U64 {
+    U64 size = 0;
+    for (auto c : s) size += UTF8Size(c);
+    return size;
+}
+
+/// Encode \p s at \p out, which must have room for UTF8Size(s) bytes.
+auto EncodeUTF8(std::u32string_view s, char* out) -> char* {
+    for (auto c : s) {
+        if (c < 0x80) {
+            *out++ = char(c);
+        } else if (c < 0x800) {
+            *out++ = char(0xC0 | (c >> 6));
+            *out++ = char(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            *out++ = char(0xE0 | (c >> 12));
+            *out++ = char(0x80 | ((c >> 6) & 0x3F));
+            *out++ = char(0x80 | (c & 0x3F));
+        } else {
+            *out++ = char(0xF0 | (c >> 18));
+            *out++ = char(0x80 | ((c >> 12) & 0x3F));
+            *out++ = char(0x80 | ((c >> 6) & 0x3F));
+            *out++ = char(0x80 | (c & 0x3F));
+        }
+    }
+    return out;
+}
+
+/// The text of a node as AppendNodeText() would append it. \p scratch is
+/// used for nodes whose text isn't stored in the node.
+auto NodeText(const Node& node, String& scratch) -> std::u32string_view {
+    using enum TokenType;
+    switch (node.type) {
+        case GroupBegin:
+        case GroupEnd:
+        case MacroArg:
+        case Macro:
+            scratch.clear();
+            Parser::AppendNodeText(scratch, node);
+            return scratch;
+        default: return node.string_content;
+    }
+}
+} // namespace
+
+bool Parser::ShouldEmitInParallel() const {
+    return opts.parallel_emit && std::thread::hardware_concurrency() > 1 && tokens.size() >= parallel_emit_min_tokens;
+}
+
+/// Apply replacement rules to, construct the text of, and encode the tokens
+/// on several threads. This is done in two passes over ranges of tokens: the
+/// first applies the replacement rules and computes the size of the text of
+/// each range; a prefix sum over the sizes gives the offset of each range in
+/// the output, to which the second pass writes the text of each range.
+///
+/// Raw replacement rules apply to the entire text, as matches may span ranges,
+/// so if there are any, the text is constructed first and only encoded after
+/// they have been applied.
+auto Parser::EmitParallel() -> std::string {
+    /// Nothing after the end of the file is emitted.
+    auto eof = std::find_if(tokens.begin(), tokens.end(), [](const Node& node) {
+        return node.type == TokenType::EndOfFile;
+    });
+
+    const U64  threads = std::thread::hardware_concurrency();
+    const U64  end     = U64(eof - tokens.begin());
+    const U64  count   = std::min(end, threads * parallel_emit_ranges_per_thread);
+    const bool encode  = raw_rep_rules.processed.empty() && regex_rules.empty();
+    auto       Range   = [&](U64 i) {
+        return std::span{tokens}.subspan(end * i / count, end * (i + 1) / count - end * i / count);
+    };
+
+    /// Pass 1: replacement and sizes.
+    std::vector<U64> offsets(count);
+    ParallelFor(count, threads, [&](U64 i) {
+        String scratch;
+        U64    size = 0;
+        for (auto& node : Range(i)) {
+            if (node.type == TokenType::Text) ApplyReplacementRules(node.string_content);
+            auto text = NodeText(node, scratch);
+            size      += encode ? UTF8Size(text) : text.size();
+        }
+        offsets[i] = size;
+    });
+    const U64 total = PrefixSum(offsets);
+
+    /// Pass 2: write the text of each range to its place in the output.
+    if (encode) {
+        std::string out(total, '\0');
+        ParallelFor(count, threads, [&](U64 i) {
+            String scratch;
+            char*  pos = out.data() + offsets[i];
+            for (const auto& node : Range(i)) pos = EncodeUTF8(NodeText(node, scratch), pos);
+        });
+        return out;
+    }
+
+    processed_text.resize(total);
+    ParallelFor(count, threads, [&](U64 i) {
+        String scratch;
+        auto   pos = processed_text.begin() + I64(offsets[i]);
+        for (const auto& node : Range(i)) pos = std::ranges::copy(NodeText(node, scratch), pos).out;
+    });
+    ApplyRawReplacementRules();
+
+    /// Encode the final text in pieces as well.
+    std::u32string_view text   = processed_text;
+    const U64           pieces = std::min(text.size(), threads * parallel_emit_ranges_per_thread);
+    auto                Piece  = [&](U64 i) {
+        return text.substr(text.size() * i / pieces, text.size() * (i + 1) / pieces - text.size() * i / pieces);
+    };
+
+    std::vector<U64> piece_offsets(pieces);
+    ParallelFor(pieces, threads, [&](U64 i) { piece_offsets[i] = UTF8Size(Piece(i)); });
+
+    std::string out(PrefixSum(piece_offsets), '\0');
+    ParallelFor(pieces, threads, [&](U64 i) { EncodeUTF8(Piece(i), out.data() + piece_offsets[i]); });
+    return out;
+}
+} // namespace TeX
@@ -0,0 +1,219 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace TeX {
+namespace {
+/// Inputs smaller than this are lexed on the parser's thread.
+constexpr U64 parallel_lex_min_size = 1 << 20;
+
+/// Approximate size of the pieces that are lexed in parallel, in bytes.
+constexpr U64 parallel_lex_chunk_size = 256 * 1024;
+
+/// Split \p text into about \p count pieces, each ending with a line break.
+auto SplitAtLines(std::string_view text, U64 count) -> std::vector<std::string_view> {
+    std::vector<std::string_view> pieces;
+    while (!text.empty()) {
+        auto pos = count > 1 ? text.find('\n', text.size() / count) : std::string_view::npos;
+        auto len = pos == std::string_view::npos ? text.size() : pos + 1;
+        pieces.push_back(text.substr(0, len));
+        text.remove_prefix(len);
+        if (count > 1) count--;
+    }
+    return pieces;
+}
+} // namespace
+
+auto Parser::Classify(const std::string& path, const Options& opts) -> InputKind {
+    if (ChunkedReader::IsStream(path) || ChunkedReader::IsCompressed(path)) return InputKind::Stream;
+    if (TokenDump::IsTokenDump(path)) return InputKind::TokenDump;
+    if (opts.parallel_lexing && std::thread::hardware_concurrency() > 1) {
+        struct stat st {};
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && U64(st.st_size) >= parallel_lex_min_size)
+            return InputKind::Parallel;
+    }
+    return InputKind::File;
+}
+
+Parser::Parser(const Options& _opts, const String& text, U32 begin)
+    : LexerBase("/dev/null"), opts(_opts), input_text(&text) {
+    auto file = sources.AddStream("<chunk>");
+    open_files.push_back({file, begin, sources.Length(file)});
+}
+
+Parser::Parser(const std::string& path, const Options& _opts, const String& text, NodeList tokens)
+    : LexerBase("/dev/null"), opts(_opts), input_text(&text) {
+    speculative = std::make_unique<SpeculativeLexer>(opts, std::move(tokens), U32(text.size() + 1));
+    auto file   = sources.Add(path, text);
+    open_files.push_back({file, 0, sources.Length(file)});
+    dependencies.push_back(path);
+}
+
+/// Continue lexing at \p offset, as though everything before it had just been read.
+void Parser::SkipTo(U32 offset) {
+    auto& f  = open_files.back();
+    f.offset = offset - 1;
+    NextChar();
+}
+
+SpeculativeLexer::SpeculativeLexer(const Options& _opts, const std::string& path, U64 threads) : opts(_opts) {
+    const auto bytes = ReadInput(path);
+    if (!bytes) throw ProcessingError("Could not open " + path + ": " + strerror(errno));
+    threads          = std::max<U64>(1, threads);
+
+    /// A line break is never part of a multibyte character, so the
+    /// pieces can be decoded independently of one another.
+    auto                pieces = SplitAtLines(*bytes, std::max<U64>(1, bytes->size() / parallel_lex_chunk_size));
+    std::vector<String> decoded(pieces.size());
+    {
+        std::atomic<U64>          next = 0;
+        std::vector<std::jthread> decoders;
+        for (U64 i = 0; i < threads; i++) {
+            decoders.emplace_back([&] {
+                for (U64 j; (j = next++) < pieces.size();) DecodeUTF8(pieces[j], decoded[j]);
+            });
+        }
+    }
+
+    /// Each chunk of tokens starts at the beginning of a line.
+    U64 size = 0;
+    for (const auto& d : decoded) size += d.size();
+    text.reserve(size);
+    for (auto& d : decoded) {
+        chunks.push_back({.start = U32(text.size())});
+        text += d;
+        String{}.swap(d);
+    }
+
+    /// Don't get too far ahead of the parser so we don't hold on to
+    /// more tokens than necessary; the parser is one of the threads.
+    window = 2 * threads;
+    for (U64 i = 1; i < threads; i++) workers.emplace_back([this] { Work(); });
+}
+
+SpeculativeLexer::SpeculativeLexer(const Options& _opts, NodeList tokens, U32 end) : opts(_opts), next_chunk(1) {
+    chunks.push_back({.start = 0, .tokens = std::move(tokens), .end = end, .ready = true});
+}
+
+SpeculativeLexer::~SpeculativeLexer() {
+    {
+        std::unique_lock lock{mtx};
+        stop = true;
+    }
+    cv.notify_all();
+    workers.clear();
+}
+
+/// Lex a chunk. Lexing is context-free except across a comment or an
+/// escape, and chunks start at the beginning of a line, so in all
+/// likelihood a chunk starts at a token boundary; if it doesn't, the
+/// parser lexes up to the first token it has in common with the chunk.
+void SpeculativeLexer::Lex(Chunk& c, U32 last) {
+    /// Growing the vector moves every token, so reserve as much
+    /// space as the chunks lexed so far suggest we need.
+    c.tokens.reserve(EstimateTokens(last - c.start + 1));
+    try {
+        Parser p{opts, text, c.start};
+        p.NextChar();
+        for (;;) {
+            p.NextToken();
+
+            /// Offsets of tokens are one past the index of their first character.
+            if (p.token.type == TokenType::EndOfFile) {
+                c.end = U32(text.size() + 1);
+                break;
+            }
+
+            /// Leave tokens that cause errors to the parser so it can report them.
+            if (p.token.loc.offset > last || p.has_error) {
+                c.end = p.token.loc.offset;
+                break;
+            }
+
+            c.tokens.push_back(std::move(p.token));
+        }
+    } catch (const ProcessingError&) {
+        /// Fatal() throws; the last token we have is still valid, but
+        /// not the offset after it, so drop it as well.
+        if (!c.tokens.empty()) {
+            c.end = c.tokens.back().loc.offset;
+            c.tokens.pop_back();
+        } else {
+            c.end = 0;
+        }
+    }
+
+    lexed_tokens += c.tokens.size();
+    lexed_chars  += last - c.start + 1;
+}
+
+/// A token is at least one character long, so until a chunk has
+/// been lexed, assume the worst. The estimate leaves some room in
+/// case the rest of the text is denser than what we've seen.
+auto SpeculativeLexer::EstimateTokens(U64 chars) const -> U64 {
+    U64 chars_so_far = lexed_chars;
+    if (!chars_so_far) return chars;
+    return std::min(chars, lexed_tokens * chars / chars_so_far * 9 / 8);
+}
+
+void SpeculativeLexer::Work() {
+    for (;;) {
+        U64 i;
+        {
+            std::unique_lock lock{mtx};
+            cv.wait(lock, [&] { return stop || (next_chunk < chunks.size() && next_chunk < chunk + window); });
+            if (stop) return;
+            i = next_chunk++;
+        }
+
+        Lex(chunks[i], i + 1 < chunks.size() ? chunks[i + 1].start : U32(text.size()));
+
+        {
+            std::unique_lock lock{mtx};
+            chunks[i].ready = true;
+        }
+        cv.notify_all();
+    }
+}
+
+auto SpeculativeLexer::Take(U32 offset, Node& token) -> std::optional<U32> {
+    while (chunk < chunks.size()) {
+        /// Lex the chunk ourselves if no-one else has started on it yet.
+        if (!chunk_ready) {
+            std::unique_lock lock{mtx};
+            if (next_chunk == chunk) {
+                next_chunk++;
+                lock.unlock();
+                Lex(chunks[chunk], chunk + 1 < chunks.size() ? chunks[chunk + 1].start : U32(text.size()));
+            } else {
+                cv.wait(lock, [&] { return chunks[chunk].ready; });
+            }
+            chunk_ready = true;
+        }
+
+        auto& tokens = chunks[chunk].tokens;
+        while (index < tokens.size() && tokens[index].loc.offset < offset) index++;
+        if (index < tokens.size()) {
+            if (tokens[index].loc.offset != offset) return std::nullopt;
+            token = std::move(tokens[index++]);
+            return index < tokens.size() ? tokens[index].loc.offset : chunks[chunk].end;
+        }
+
+        /// Free chunks once we're done with them and let the workers move on.
+        NodeList{}.swap(tokens);
+        {
+            std::unique_lock lock{mtx};
+            chunk++;
+        }
+        cv.notify_all();
+        index       = 0;
+        chunk_ready = false;
+    }
+    return std::nullopt;
+}
+} // namespace TeX
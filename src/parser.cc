@@ -1,7 +1,8 @@
+#include "hash.h"
 #include "parser.h"
 
+#include <cstdarg>
 #include <filesystem>
-#include <fmt/format.h>
 #include <list>
 #include <variant>
 namespace TeX {
@@ -21,45 +22,226 @@ Macro::Macro(NodeList _replacement) : replacement(std::move(_replacement)) {}
 Macro::Macro(std::vector<NodeList> _delimiters, NodeList _replacement)
     : replacement(std::move(_replacement)), delimiters(std::move(_delimiters)) {}
 
-Parser::Parser() : LexerBase(*options::get<"file">()) {
-    if (auto out = options::get<"-o">()) output_file = fopen(out->c_str(), "w");
-    else output_file = stdout;
-    if (!output_file) Die("Could not open output file: %s", strerror(errno));
+Parser::Parser(const std::string& path, const Options& _opts)
+    : Parser(path, _opts, Classify(path, _opts)) {}
+
+Parser::Parser(const std::string& path, const Options& _opts, InputKind kind)
+    : LexerBase("/dev/null"), opts(_opts) {
+    /// Files are read and decoded by the parser rather than by the lexer;
+    /// streams are read in chunks.
+    if (kind == InputKind::TokenDump) {
+        auto file = sources.AddStream(path);
+        open_files.push_back({file, 0, sources.Length(file)});
+        ReplayFrom(path);
+    } else if (kind == InputKind::Stream) {
+        stream    = std::make_unique<ChunkedReader>(path);
+        auto file = sources.AddStream(path == "-" ? "<stdin>" : path);
+        open_files.push_back({file, 0, sources.Length(file)});
+    } else if (kind == InputKind::Parallel) {
+        speculative = std::make_unique<SpeculativeLexer>(opts, path, std::thread::hardware_concurrency());
+        input_text  = &speculative->text;
+        auto file   = sources.Add(path, *input_text);
+        open_files.push_back({file, 0, sources.Length(file)});
+    } else {
+        auto contents = ReadInput(path);
+        if (!contents) throw ProcessingError("Could not open " + path + ": " + strerror(errno));
+        OpenMainFile(path, *contents);
+    }
+    dependencies.push_back(path);
+}
 
-    if (auto lw = options::get<"--line-width">()) line_width = *lw < 20 ? 100 : U64(*lw);
+Parser::Parser(const std::string& name, const Options& _opts, std::string_view input)
+    : LexerBase("/dev/null"), opts(_opts) {
+    OpenMainFile(name, input);
+    dependencies.push_back(name);
+}
+
+void Parser::OpenMainFile(const std::string& path, std::string_view contents) {
+    DecodeUTF8(contents, main_text);
+    input_text = &main_text;
+    auto file  = sources.Add(path, main_text);
+    open_files.push_back({file, 0, sources.Length(file)});
+}
+
+auto Parser::Here() const -> Location {
+    return {open_files.back().file, open_files.back().offset};
+}
+
+void Parser::IncludeFile(const std::string& path, std::string_view contents) {
+    String text;
+    DecodeUTF8(contents, text);
+    auto file = sources.Add(path, text);
+    open_files.push_back({file, 0, U32(text.size()), std::move(text)});
+    at_eof = false;
+}
 
+/// Read an included file, unless the prefetcher has already read it.
+auto Parser::ReadInclude(const std::string& path) -> std::optional<std::string> {
+    if (prefetcher)
+        if (auto contents = prefetcher->Claim(path)) return contents;
+    return ReadInput(path);
+}
+
+void Parser::Start() {
     Parser::NextChar();
     Parser::NextToken();
-    if (options::get<"--print-tokens">()) {
-        Parser::PrintAllTokens(output_file);
-        exit(0);
-    } else if (options::get<"--wc">()) {
-        U64         chars{};
-        U64         words = 1;
-        std::string text;
-        do {
-            if (token.type == T::Text || token.type == T::Whitespace) {
-                chars++;
-                if (token.type == T::Whitespace) words++;
-            }
-            NextToken();
-        } while (token.type != T::EndOfFile);
-        std::cout << "Number of characters: " << chars << "\n";
-        std::cout << "Number of words:      " << words << "\n";
-        exit(0);
+}
+
+auto Parser::PrintTokens() -> std::string {
+    std::string out;
+    Start();
+    while (token.type != T::EndOfFile) {
+        out += sources.Print(token.loc);
+        out += ": ";
+        out += ToUTF8(StringiseType(token));
+        NextToken();
     }
-    if (options::get<"--format">()) {
-        Parser::Format();
-        exit(0);
+    ThrowIfError();
+    return out;
+}
+
+auto Parser::CountWords() -> WordCount {
+    PhaseScope phase{Phase::Parse};
+    WordCount  wc{.words = 1};
+    Start();
+    do {
+        CountToken(wc, token);
+        NextToken();
+    } while (token.type != T::EndOfFile);
+    ThrowIfError();
+    return wc;
+}
+
+void Parser::CountToken(WordCount& wc, const Node& token) {
+    if (token.type == T::Text || token.type == T::Whitespace) {
+        wc.chars++;
+        if (token.type == T::Whitespace) wc.words++;
+    }
+}
+
+auto Parser::Preprocess() -> std::string {
+    /// Directives such as \Include and \Replace operate on the input text, which a dump doesn't contain.
+    if (replay) throw ProcessingError(dependencies.front() + ": Cannot preprocess a token dump");
+    if (opts.prefetch_includes && input_text) prefetcher = std::make_unique<IncludePrefetcher>(*input_text);
+
+    /// In --watch mode, pick up where we left off if possible.
+    if (watch && watch->resume) {
+        Parser::ResumeFrom(*watch->resume);
+        if (token.type != T::EndOfFile) Parser::Parse();
+    } else {
+        if (watch) {
+            watch->includes.clear();
+            watch->snapshots.clear();
+            watch->state.reset();
+            macros.KeepHistory();
+        }
+
+        Start();
+        if (opts.pipeline && !watch) return Parser::ParseAndEmitPipelined();
+        Parser::Parse();
+    }
+
+    /// Watch the files that were included even if there were errors, so
+    /// we notice when they're fixed.
+    if (watch) {
+        watch->dependencies = dependencies;
+        watch->resume.reset();
+    }
+
+    for (const auto& c : conditionals) Error(c.loc, "Unterminated \\IfDefined");
+    if (profiler) profiler->Stop();
+    ThrowIfError();
+
+    /// Only resume from a run without errors, since the diagnostics
+    /// issued before the resume point wouldn't be issued again. Emit()
+    /// modifies the tokens, so save them first.
+    if (watch) {
+        watch->tokens = tokens;
+        parsed        = true;
     }
-    Parser::Parse();
-    if (!has_error) Parser::Emit();
+    return Parser::Emit();
 }
 
+void Parser::Error(Location where, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    auto len = vsnprintf(nullptr, 0, fmt, ap);
+    va_end(ap);
+
+    std::string msg(U64(len), '\0');
+    va_start(ap, fmt);
+    vsnprintf(msg.data(), msg.size() + 1, fmt, ap);
+    va_end(ap);
+
+    has_error = true;
+    diagnostics.push_back(sources.Print(where) + ": Error: " + msg);
+}
+
+void Parser::Fatal(Location where, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    auto len = vsnprintf(nullptr, 0, fmt, ap);
+    va_end(ap);
+
+    std::string msg(U64(len), '\0');
+    va_start(ap, fmt);
+    vsnprintf(msg.data(), msg.size() + 1, fmt, ap);
+    va_end(ap);
+
+    diagnostics.push_back(sources.Print(where) + ": Fatal: " + msg);
+    has_error = true;
+    ThrowIfError();
+    Unreachable("Fatal");
+}
+
+void Parser::ThrowIfError() {
+    if (!has_error) return;
+    std::string msg;
+    for (const auto& d : diagnostics) {
+        if (!msg.empty()) msg += '\n';
+        msg += d;
+    }
+    throw ProcessingError(msg);
+}
+
+void Parser::NextChar() {
+    /// Return to the including file once an included file has been read.
+    while (open_files.size() > 1 && open_files.back().offset >= open_files.back().length) open_files.pop_back();
+
+    /// The main file is read from the stream if it is one.
+    if (stream && open_files.size() == 1) {
+        auto c = stream->Next();
+        if (!c) {
+            at_eof = true;
+            lastc  = Eof;
+            return;
+        }
+
+        lastc   = *c;
+        auto& f = open_files.back();
+        f.offset++;
+        if (lastc == U'\n') sources.AddLineStart(f.file, f.offset);
+        return;
+    }
+
+    /// Otherwise, read from the decoded text; a token dump has none.
+    auto&       f    = open_files.back();
+    const auto* text = open_files.size() > 1 ? &f.text : input_text;
+    if (!text || f.offset == text->size()) {
+        at_eof = true;
+        lastc  = Eof;
+        return;
+    }
+
+    lastc = (*text)[f.offset++];
+}
 
 void Parser::LexLineComment() {
     /// Lexer is at '%'
-    token.string_content = ReadUntilChar('\n');
+    while (!at_eof && lastc != U'\n') {
+        token.string_content += lastc;
+        NextChar();
+    }
 
     /// Append the newline and discard it
     if (!at_eof) {
@@ -104,7 +286,7 @@ void Parser::LexCommandSequence() {
 }
 
 void Parser::LexText() {
-    if (I32(lastc) == EOF) Die("LexText called at end of file");
+    if (I32(lastc) == EOF) Fatal(Here(), "LexText called at end of file");
     if (IsSpace(lastc)) {
         token.type = TokenType::Whitespace;
         do {
@@ -123,18 +305,29 @@ void Parser::NextToken() {
     if (!lookahead_queue.empty()) {
         token = std::move(lookahead_queue.front());
         lookahead_queue.pop();
+        if (profiler) profiler->TokenFromQueue();
         return;
     }
 
-    token     = Token();
+    token = Token();
+    if (profiler) profiler->TokenFromInput();
+    if (replay) return ReplayToken();
     token.loc = Here();
 
+    /// Use the token lexed ahead of time if there is one.
+    if (speculative && open_files.size() == 1 && !at_eof) {
+        if (auto next = speculative->Take(token.loc.offset, token)) {
+            token.loc.file = open_files.back().file;
+            return SkipTo(*next);
+        }
+    }
+
     if (at_eof) {
         token.type = TokenType::EndOfFile;
         return;
     }
 
-    if (I32(lastc) == EOF) Die("NextToken: at_eof not set at end of file!");
+    if (I32(lastc) == EOF) Fatal(Here(), "NextToken: at_eof not set at end of file!");
 
     token.type = TokenType(lastc);
     switch (lastc) {
@@ -165,34 +358,46 @@ void Parser::SkipCharsUntilIfWhitespace(Char c) {
 }
 
 void Parser::Parse() {
+    PhaseScope phase{Phase::Parse};
     do {
-        ParseSequence();
+        if (ParseSequence()) continue;
         tokens.push_back(token);
         NextToken();
     } while (token.type != T::EndOfFile);
 }
 
-void Parser::ParseSequence() {
+/// Process the current token. Returns true if it was consumed, in which
+/// case the token after it is the current token and hasn't been processed.
+bool Parser::ParseSequence() {
     using enum TokenType;
     switch (token.type) {
         case GroupBegin:
             group_count++;
-            break;
+            macros.EnterGroup();
+            return false;
         case GroupEnd:
             group_count--;
-            break;
+            macros.LeaveGroup();
+            return false;
         case CommandSequence:
-            ParseCommandSequence();
-            break;
-        default:;
+            return ParseCommandSequence();
+        default: return false;
     }
 }
 
 NodeList Parser::ParseGroup(bool keep_closing_brace) {
     SkipCharsUntilIfWhitespace('{');
     Expect(TokenType::GroupBegin);
+    if (token.type != TokenType::GroupBegin) return {};
+    return ParseGroupContents(Here(), keep_closing_brace);
+}
+
+/// Parse the rest of a group whose '{' is the current token. \p here
+/// is where its contents start.
+NodeList Parser::ParseGroupContents(Location here, bool keep_closing_brace) {
     group_count++;
-    auto here = Here();
+    macros.EnterGroup();
+    parse_depth++;
     NextToken(); /// yeet '{'
 
     if (at_eof) Error(here, "Group terminated by end of file");
@@ -205,16 +410,16 @@ NodeList Parser::ParseGroup(bool keep_closing_brace) {
             do NextToken();
             while (token.type == TokenType::LineComment);
         }
-        ParseSequence();
+        if (ParseSequence()) continue;
         if (token.type == TokenType::GroupEnd && group_count < depth) break;
         lst.push_back(token);
         NextToken();
     }
 
     if (at_eof) Error(here, "Group terminated by end of file");
-    if (token.type != TokenType::GroupEnd) Unreachable("ParseGroup");
-    if (!keep_closing_brace) NextToken(); /// yeet '}'
+    if (token.type == TokenType::GroupEnd && !keep_closing_brace) NextToken(); /// yeet '}'
 
+    parse_depth--;
     return lst;
 }
 
@@ -247,6 +452,180 @@ void Parser::HandleReplace() {
     }
 }
 
+void Parser::HandleReplaceRegex() {
+    auto here = Here();
+    SkipCharsUntilIfWhitespace('{');
+    if (lastc != '{') LEXER_ERROR("Syntax of \\ReplaceRegex is \\ReplaceRegex{pattern}{replacement}");
+    NextChar(); /// yeet '{'
+
+    String pattern = ReadBalancedGroup();
+    if (at_eof) LEXER_ERROR("Syntax of \\ReplaceRegex is \\ReplaceRegex{pattern}{replacement}");
+    NextChar(); /// yeet '}'
+
+    SkipCharsUntilIfWhitespace('{');
+    if (lastc != '{') LEXER_ERROR("Syntax of \\ReplaceRegex is \\ReplaceRegex{pattern}{replacement}");
+    NextChar(); /// yeet '{'
+
+    String replacement = ReadBalancedGroup();
+    if (at_eof) LEXER_ERROR("Syntax of \\ReplaceRegex is \\ReplaceRegex{pattern}{replacement}");
+    NextChar(); /// yeet '}'
+
+    /// Compile the pattern now so that errors are reported where it is defined.
+    if (auto err = regex_rules.Add(pattern, replacement)) Error(here, "%s", err->c_str());
+    NextToken();
+}
+
+void Parser::HandleInclude(bool once) {
+    NextNonWhitespaceToken(); /// yeet '\Include'
+    auto group = ParseGroup(true);
+    if (token.type != TokenType::GroupEnd) return;
+    auto path = ToUTF8(Trim(AsTextNode(group)));
+
+    /// A file that is skipped is still a dependency.
+    std::optional<std::string> contents;
+    if (IncludedBefore(path, once, contents)) {
+        dependencies.push_back(std::move(path));
+        NextToken(); /// yeet '}'
+        return;
+    }
+
+    if (watch) RecordInclude(path);
+    if (contents) IncludeFile(path, *contents);
+    else Error(token.loc, "Could not open file '%s': %s", path.c_str(), strerror(errno));
+    dependencies.push_back(std::move(path));
+    NextToken();
+}
+
+/// Record that a file is being included and read it into \p contents
+/// unless it is skipped. If \p once is true, check whether it, or a file
+/// with the same contents, has been included already.
+bool Parser::IncludedBefore(const std::string& path, bool once, std::optional<std::string>& contents) {
+    std::error_code ec;
+    auto            canonical = std::filesystem::weakly_canonical(path, ec);
+    if (ec) canonical = NormalisePath(path);
+    if (!include_guard.AddPath(canonical) && once) return true;
+
+    /// If the file can't be read, let HandleInclude() report the error.
+    contents = ReadInclude(path);
+    if (!once || !contents) return false;
+    return !include_guard.AddHash(XXH64(*contents));
+}
+
+void Parser::HandleIfDefined() {
+    auto where = token.loc;
+    SkipCharsUntilIfWhitespace('{');
+    if (lastc != '{') LEXER_ERROR("Syntax of \\IfDefined is \\IfDefined{\\macro}");
+    NextChar(); /// yeet '{'
+
+    auto name = Trim(ReadBalancedGroup());
+    if (at_eof) LEXER_ERROR("Syntax of \\IfDefined is \\IfDefined{\\macro}");
+    NextChar(); /// yeet '}'
+
+    /// If the condition is false, skip to the \Else or \EndIf.
+    if (macros.Contains(name)) conditionals.push_back({where, group_count});
+    else switch (SkipConditional()) {
+        case ConditionalEnd::Else: conditionals.push_back({where, group_count}); break;
+        case ConditionalEnd::EndIf: break;
+        case ConditionalEnd::EndOfGroup: Error(where, "\\IfDefined must be terminated in the group it appears in"); break;
+        case ConditionalEnd::EndOfFile: Error(where, "Unterminated \\IfDefined"); break;
+    }
+    NextToken();
+}
+
+void Parser::HandleElse() {
+    if (conditionals.empty() || conditionals.back().group_count != group_count) {
+        Error(token.loc, "\\Else without \\IfDefined in the same group");
+        return NextToken();
+    }
+
+    /// We've just finished the enabled branch, so skip the \Else branch.
+    auto where = conditionals.back().loc;
+    conditionals.pop_back();
+    for (;;) {
+        auto end = SkipConditional();
+        if (end == ConditionalEnd::Else) {
+            Error(Here(), "Duplicate \\Else");
+            continue;
+        }
+        if (end == ConditionalEnd::EndOfGroup) Error(where, "\\IfDefined must be terminated in the group it appears in");
+        if (end == ConditionalEnd::EndOfFile) Error(where, "Unterminated \\IfDefined");
+        break;
+    }
+    NextToken();
+}
+
+void Parser::HandleEndIf() {
+    if (conditionals.empty() || conditionals.back().group_count != group_count) Error(token.loc, "\\EndIf without \\IfDefined in the same group");
+    else conditionals.pop_back();
+    NextToken();
+}
+
+/// Skip a disabled branch of a conditional up to and including the \Else
+/// or \EndIf that ends it. This works on characters rather than tokens so
+/// that the contents of the branch are never lexed or stored; it only has
+/// to keep track of comments, braces, escapes and nested conditionals.
+/// Directives in nested groups are skipped along with the group.
+auto Parser::SkipConditional() -> ConditionalEnd {
+    static constexpr std::u32string_view if_defined = U"IfDefined";
+    static constexpr std::u32string_view else_      = U"Else";
+    static constexpr std::u32string_view end_if     = U"EndIf";
+
+    U64 braces  = 0;
+    U64 nesting = 0;
+    while (!at_eof) {
+        switch (lastc) {
+            case U'%':
+                while (!at_eof && lastc != U'\n') NextChar();
+                break;
+
+            case U'{':
+                braces++;
+                NextChar();
+                break;
+
+            case U'}':
+                if (!braces) return ConditionalEnd::EndOfGroup;
+                braces--;
+                NextChar();
+                break;
+
+            case U'\\': {
+                NextChar(); /// yeet '\'
+                if (at_eof) return ConditionalEnd::EndOfFile;
+                if (!IsLetter(lastc)) {
+                    NextChar(); /// yeet escaped character
+                    break;
+                }
+
+                /// Match the name against the directives as we go.
+                U64  len     = 0;
+                bool is_if   = true;
+                bool is_else = true;
+                bool is_end  = true;
+                do {
+                    is_if   = is_if && len < if_defined.size() && if_defined[len] == lastc;
+                    is_else = is_else && len < else_.size() && else_[len] == lastc;
+                    is_end  = is_end && len < end_if.size() && end_if[len] == lastc;
+                    len++;
+                    NextChar();
+                } while (!at_eof && IsLetter(lastc));
+
+                if (braces) break;
+                if (is_if && len == if_defined.size()) nesting++;
+                else if (is_else && len == else_.size() && !nesting) return ConditionalEnd::Else;
+                else if (is_end && len == end_if.size()) {
+                    if (!nesting) return ConditionalEnd::EndIf;
+                    nesting--;
+                }
+            } break;
+
+            default:
+                NextChar();
+        }
+    }
+    return ConditionalEnd::EndOfFile;
+}
+
 std::vector<NodeList> Parser::ParseMacroArgs() {
     using enum TokenType;
     std::vector<NodeList> args;
@@ -275,92 +654,111 @@ std::vector<NodeList> Parser::ParseMacroArgs() {
 void Parser::HandleDefine() {
     NextNonWhitespaceToken(); /// yeet '\Define'
     Expect(TokenType::CommandSequence);
-    String cs = token.string_content;
+    String cs    = token.string_content;
+    auto   where = token.loc;
     NextNonWhitespaceToken(); /// yeet csname
-    if (token.type == TokenType::MacroArg) macros[cs] = {ParseMacroArgs(), ParseGroup()};
-    else macros[cs] = ParseGroup();
+
+    Macro macro;
+    if (token.type == TokenType::MacroArg) macro.delimiters = ParseMacroArgs();
+    macro.loc = where;
+    ParseDefinitionBody(macro);
+    macros.Define(cs, std::move(macro));
 }
 
-void Parser::ParseCommandSequence() {
+bool Parser::ParseCommandSequence() {
     if (token.string_content == U"\\Define") {
         HandleDefine();
     } else if (token.string_content == U"\\Undef") {
         NextNonWhitespaceToken(); /// yeet '\Undef'
         Expect(TokenType::CommandSequence);
-        if (macros.contains(token.string_content)) macros.erase(token.string_content);
+        macros.Undefine(token.string_content);
         NextToken(); /// yeet cs
     } else if (token.string_content == U"\\Replace") {
         HandleReplace();
+    } else if (token.string_content == U"\\ReplaceRegex") {
+        HandleReplaceRegex();
+    } else if (token.string_content == U"\\IfDefined") {
+        HandleIfDefined();
+    } else if (token.string_content == U"\\Else") {
+        HandleElse();
+    } else if (token.string_content == U"\\EndIf") {
+        HandleEndIf();
     } else if (token.string_content == U"\\Include") {
-        NextNonWhitespaceToken(); /// yeet '\Include'
-        auto group = ParseGroup(true);
-        IncludeFile(ToUTF8(Trim(AsTextNode(group))));
-        NextToken();
+        HandleInclude(false);
+    } else if (token.string_content == U"\\IncludeOnce") {
+        HandleInclude(true);
     } //else if (token.string_content == U"\\Eval") {
         // HandleEval();
     //}
-    else if (macros.contains(token.string_content)) {
+    else if (macros.Contains(token.string_content)) {
         HandleMacroExpansion();
-    }
+    } else return false;
+    return true;
 }
 
-void Parser::Emit() {
+auto Parser::Emit() -> std::string {
+    PhaseScope phase{Phase::Emit};
     ProcessReplacementRules();
     MergeTextNodes(tokens);
-    for (auto& m : macros) MergeTextNodes(m.second.replacement);
+    if (ShouldEmitInParallel()) return EmitParallel();
     ProcessReplacement(tokens);
     ConstructText(tokens);
     ApplyRawReplacementRules();
-    fmt::print(output_file, "{}", ToUTF8(processed_text));
+    return ToUTF8(processed_text);
 }
 
+/// Whether a command sequence is a macro is decided when it is parsed:
+/// a macro is expanded then, so there is no need to check the nodes
+/// against the macro table, which only holds the definitions in effect
+/// at the end of the input, and e.g. not those undone by a group.
 void Parser::ConstructText(NodeList& nodes) {
-    using enum TokenType;
     for (auto& node : nodes) {
-        switch (node.type) {
-            case GroupBegin:
-                processed_text += U'{';
-                break;
-            case GroupEnd:
-                processed_text += U'}';
-                break;
-            case Whitespace:
-                goto _default;
-            case CommandSequence:
-                if (macros.contains(node.string_content))
-                    Unreachable("ConstructText: Unexpanded macro \'"
-                                << ToUTF8(node.string_content) << "\'");
-                else processed_text += node.string_content;
-                continue;
-            case EndOfFile: return;
-            case MacroArg: {
-                auto num = node.number;
-                processed_text += U"#";
-
-                if (num >= 10) {
-                    num -= 10;
-                    processed_text += U"#";
-                }
+        if (!AppendNodeText(processed_text, node)) return;
+    }
+}
 
-                processed_text += ToUTF32(std::to_string(num));
-            } break;
-            case Macro:
-                Unreachable("ConstructText: Macro should have been removed from NodeList");
-            default:
-            _default:
-                processed_text += node.string_content;
-        }
+bool Parser::AppendNodeText(String& text, const Node& node) {
+    using enum TokenType;
+    switch (node.type) {
+        case GroupBegin:
+            text += U'{';
+            break;
+        case GroupEnd:
+            text += U'}';
+            break;
+        case EndOfFile: return false;
+        case MacroArg: {
+            auto num = node.number;
+            text += U"#";
+
+            if (num >= 10) {
+                num -= 10;
+                text += U"#";
+            }
+
+            text += ToUTF32(std::to_string(num));
+        } break;
+        case Macro:
+            Unreachable("ConstructText: Macro should have been removed from NodeList");
+        default:
+            text += node.string_content;
     }
+    return true;
 }
 
 void Parser::ApplyReplacementRules(String& str) {
-    for (const auto& [text, replacement] : rep_rules.processed)
+    ApplyReplacementRules(str, rep_rules.processed);
+}
+
+void Parser::ApplyReplacementRules(String& str, const std::vector<std::pair<String, String>>& rules) {
+    for (const auto& [text, replacement] : rules)
         ReplaceAll(str, text, replacement);
 }
 
 void Parser::ApplyRawReplacementRules() {
     for (const auto& [text, replacement] : raw_rep_rules.processed)
         ReplaceAll(processed_text, text, replacement);
+    regex_rules.Apply(processed_text);
 }
 
 void Parser::ProcessReplacement(NodeList& nodes) {
@@ -385,12 +783,12 @@ String Parser::AsTextNode(const NodeList& lst) {
                 text.append(node.string_content);
                 break;
             case CommandSequence:
-                if (macros.contains(node.string_content))
-                    text.append(AsTextNode(macros[node.string_content].replacement));
-                else text.append(node.string_content);
+                if (auto m = macros.Use(node.string_content)) {
+                    text.append(AsTextNode(Replacement(*m)));
+                } else text.append(node.string_content);
                 break;
             default:
-                Die("Serialisation of type %s is not implemented", TokenTypeToString(node.type).c_str());
+                Fatal(node.loc, "Serialisation of type %s is not implemented", TokenTypeToString(node.type).c_str());
         }
     }
     return text;
@@ -402,6 +800,26 @@ void Parser::ProcessReplacementRules() {
     for (const auto& [text, replacement] : raw_rep_rules.rules)
         raw_rep_rules.processed.emplace_back(AsTextNode(text), AsTextNode(replacement));
 }
+
+/// Read up to the matching '}'. Unlike ReplaceReadUntilBrace(),
+/// this leaves escape sequences alone.
+String Parser::ReadBalancedGroup() {
+    String text;
+    U64    depth = 0;
+    while (!at_eof && (lastc != U'}' || depth)) {
+        if (lastc == U'{') depth++;
+        else if (lastc == U'}') depth--;
+        else if (lastc == U'\\') {
+            text += lastc;
+            NextChar();
+            if (at_eof) break;
+        }
+        text += lastc;
+        NextChar();
+    }
+    return text;
+}
+
 String Parser::ReplaceReadUntilBrace() {
     String text;
     while (!at_eof && lastc != U'}') {
@@ -430,8 +848,6 @@ String Parser::ReplaceReadUntilBrace() {
 String StringiseType(const Node& token) {
     using enum TokenType;
     String s;
-    s += (String) token.loc;
-    s += U": ";
     switch (token.type) {
         case Invalid: s += U"[Invalid: "; break;
         case Whitespace: s += U"[Whitespace: "; break;
@@ -473,6 +889,7 @@ std::string Parser::TokenTypeToString(TokenType type) {
 }
 
 void Parser::MergeTextNodes(NodeList& _lst, bool merge_whitespace) {
+    PhaseScope phase{Phase::MergeTextNodes};
     using enum TokenType;
     std::list<Node> nodes;
     for (auto&& item : _lst) nodes.push_back(std::move(item));
@@ -514,9 +931,11 @@ void Parser::LexMacroArg() {
 }
 
 void Parser::HandleMacroExpansion() {
-    const auto&           macro = macros[token.string_content];
+    PhaseScope            phase{Phase::HandleMacroExpansion};
+    auto&                 macro = *macros.Use(token.string_content);
     auto                  here  = Here();
     std::vector<NodeList> args;
+    U32                   frame = profiler ? profiler->BeginExpansion(token.string_content) : 0;
     NextToken(); /// yeet the macro name
     for (const auto& delim : macro.delimiters) {
         if (delim.empty()) {
@@ -531,6 +950,7 @@ void Parser::HandleMacroExpansion() {
                     NextToken(); /// yeet token
                 }
                 if (at_eof) {
+                    if (profiler) profiler->EndArguments(frame);
                     Error(here, "Eof reached while parsing macro arguments");
                     return;
                 }
@@ -542,6 +962,7 @@ void Parser::HandleMacroExpansion() {
                 } while (!at_eof && i < sz && token == d_token);
                 if (i == sz) goto next_delim;
                 if (at_eof) {
+                    if (profiler) profiler->EndArguments(frame);
                     Error(here, "Eof reached while parsing macro arguments");
                     return;
                 }
@@ -552,18 +973,20 @@ void Parser::HandleMacroExpansion() {
         }
     }
 
-    for (const auto& tok : macro.replacement) {
+    if (profiler) profiler->EndArguments(frame);
+    for (const auto& tok : Replacement(macro)) {
         if (tok.type == TokenType::MacroArg) {
             const U64 offset = tok.number % 10 - 1;
             if (offset >= args.size())
                 Fatal(here, "Macro arg index too big: %zu; size was: %zu", offset, args.size());
-            for (const auto& node : args[offset]) PushLookahead(node);
-        } else PushLookahead(tok);
+            for (const auto& node : args[offset]) PushLookahead(node, frame);
+        } else PushLookahead(tok, frame);
     }
 }
 
-void Parser::PushLookahead(const Node& node) {
+void Parser::PushLookahead(const Node& node, U32 profiler_frame) {
     lookahead_queue.push(node);
+    if (profiler) profiler->Queued(profiler_frame);
     if (token.type == TokenType::EndOfFile) NextToken();
 }
 
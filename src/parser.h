@@ -1,17 +1,32 @@
 #ifndef XPP_PARSER_H
 #define XPP_PARSER_H
 
-#include "../clopts/include/clopts.hh"
+#include "compression.h"
+#include "format_rules.h"
+#include "phase.h"
+#include "profiler.h"
+#include "regex.h"
+#include "token_dump.h"
+#include "xpp.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
+#include <set>
+#include <span>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utils/parser.h>
 
 namespace TeX {
-/*struct AST {
-};*/
-
 enum struct TokenType : Char {
     Invalid,
     Text,
@@ -25,86 +40,614 @@ enum struct TokenType : Char {
     GroupEnd    = U'}',
 };
 
-struct Node : public TokenBase<char32_t, TokenType, SourceLocationBase<>> {
+/// Position of a token as an offset in characters into one of the files
+/// read by the parser. Line and column are only computed when needed.
+struct Location {
+    U32 file   = 0;
+    U32 offset = 0;
+};
+
+/// The files read by a parser. The index of line starts of a file is
+/// built from its decoded text when the file is added, since the text
+/// isn't kept around until a location in it has to be resolved.
+class SourceMap {
+    struct File {
+        std::string      path;
+        U32              length;
+        std::vector<U32> line_starts;
+    };
+
+    std::vector<File>          files;
+    std::map<std::string, U32> ids;
+
+    /// Compute the line and column of a location.
+    auto LineAndColumn(Location loc) const -> std::pair<U64, U64>;
+
+public:
+    /// Register a file whose contents are \p text and return its ID.
+    auto Add(const std::string& path, const String& text) -> U32;
+
+    /// Register a file without reading it, e.g. one named in a token
+    /// dump, given the offsets at which its lines start. Its length is
+    /// unknown, but locations in it can be printed.
+    auto AddUnread(const std::string& path, std::vector<U32> line_starts) -> U32;
+
+    /// Register a stream. Since a stream can't be read twice, its
+    /// line starts must be recorded as it is read.
+    auto AddStream(const std::string& name) -> U32;
+    void AddLineStart(U32 file, U32 offset) { files[file].line_starts.push_back(offset); }
+
+    /// Length of a file in characters.
+    auto Length(U32 file) const -> U32 { return files[file].length; }
+
+    /// Offsets at which the lines of a file start.
+    auto LineStarts(U32 file) const -> const std::vector<U32>& { return files[file].line_starts; }
+
+    /// Number of files.
+    auto Count() const -> U64 { return files.size(); }
+
+    /// Path of a file.
+    auto Path(U32 file) const -> const std::string& { return files[file].path; }
+
+    /// Remove all files but the first \p count.
+    void Truncate(U64 count);
+
+    /// Format a location as 'file:line:col'.
+    auto Print(Location loc) const -> std::string;
+};
+
+struct Node : public TokenBase<char32_t, TokenType, Location> {
     String Str() const override;
 };
 
 using NodeList      = std::vector<Node>;
 using AbstractLexer = LexerBase<FileBase<>, Node>;
 
+/// The structure of a token list. The tokens are stored in one flat
+/// array, along with the index of the matching token of every "{" and
+/// "}", and of every \begin and \end. The index is built in a single
+/// pass, so passes over the tokens can find the end of a group or
+/// environment without counting braces.
+class AST {
+    NodeList         nodes;
+    std::vector<U32> partner;
+
+public:
+    /// Partner of a token that isn't a delimiter or is unbalanced.
+    static constexpr U32 none = U32(-1);
+
+    explicit AST(NodeList tokens);
+
+    auto Nodes() const -> const NodeList& { return nodes; }
+
+    /// Index of the token matching the delimiter at \p index, if any.
+    auto Match(U64 index) const -> std::optional<U64> {
+        if (partner[index] == none) return std::nullopt;
+        return partner[index];
+    }
+};
+
 struct ReplacementRules {
     std::vector<std::pair<NodeList, NodeList>> rules;
     std::vector<std::pair<String, String>>     processed;
 };
 
+/// Replacement rules as seen by the emission stage of the pipeline
+/// at the time a batch of tokens was parsed.
+struct RuleSnapshot {
+    std::vector<std::pair<String, String>> rules;
+    bool                                   has_raw_rules = false;
+};
+
+/// A batch of tokens passed between the stages of the pipeline.
+struct TokenBatch {
+    NodeList                            nodes;
+    std::shared_ptr<const RuleSnapshot> rules;
+    String                              text;
+    std::string                         utf8;
+    bool                                last = false;
+};
+
+/// Reads the files named in literal \Include directives on background
+/// threads so that they're already in the page cache by the time the
+/// parser gets to them. Includes whose path depends on a macro expansion
+/// aren't seen by the prefetcher and are read synchronously as usual.
+class IncludePrefetcher {
+    enum struct State {
+        Queued,
+        Reading,
+        Done,
+    };
+
+    struct File {
+        State                      state = State::Queued;
+        std::optional<std::string> contents;
+    };
+
+    std::mutex                  mtx;
+    std::condition_variable     cv;
+    std::deque<std::string>     queue;
+    std::map<std::string, File> files;
+    std::vector<std::thread>    workers;
+    bool                        stop = false;
+
+    void Enqueue(std::string path);
+    void Work();
+
+public:
+    /// Start prefetching the files included by \p main_text, which
+    /// must outlive the prefetcher.
+    explicit IncludePrefetcher(const String& main_text);
+    ~IncludePrefetcher();
+
+    /// Called by the parser before it reads an included file. Returns
+    /// the contents of the file if it has been prefetched, and waits if
+    /// it is currently being read so we don't read it twice. Otherwise,
+    /// the parser reads the file itself.
+    auto Claim(const std::string& path) -> std::optional<std::string>;
+
+    /// Find the paths of all \Include directives whose argument is literal text.
+    template <typename CharType>
+    static auto ScanIncludes(std::basic_string_view<CharType> text) -> std::vector<std::string>;
+};
+
+/// Reads UTF-8 text from stdin or a pipe in fixed-size chunks. This
+/// is used instead of the lexer's own file handling for input that
+/// can't (or shouldn't) be read in its entirety up front.
+class ChunkedReader {
+    static constexpr Char replacement_char = 0xFFFD;
+
+    std::unique_ptr<char[]>       buffer;
+    std::unique_ptr<Decompressor> decompressor;
+    std::string                   decompressed;
+    const char*                   data = nullptr;
+    int                           fd;
+    bool                          owned   = false;
+    bool                          started = false;
+    bool                          eof     = false;
+    U64                           pos     = 0;
+    U64                           size    = 0;
+
+    auto Read(char* into, U64 capacity) -> U64;
+    bool Refill();
+
+public:
+    /// '-' is stdin. Input compressed with gzip or zstd is decompressed.
+    explicit ChunkedReader(const std::string& path);
+    ~ChunkedReader();
+
+    ChunkedReader(const ChunkedReader&)            = delete;
+    ChunkedReader& operator=(const ChunkedReader&) = delete;
+
+    /// Get the next character, or nullopt at the end of the input.
+    auto Next() -> std::optional<Char>;
+
+    /// Check whether a path refers to stdin or a pipe.
+    static bool IsStream(const std::string& path);
+
+    /// Check whether a file is compressed.
+    static bool IsCompressed(const std::string& path);
+};
+
+/// The main file, decoded up front and lexed ahead of time on several
+/// threads; see parallel_lex.cc. The parser takes a token from here
+/// whenever one starts exactly where it is in the file and lexes the
+/// input itself otherwise, so the tokens it sees are always the same.
+class SpeculativeLexer {
+    struct Chunk {
+        U32      start = 0;
+        NodeList tokens{};
+
+        /// Offset of the token after the last one in this chunk.
+        U32  end   = 0;
+        bool ready = false;
+    };
+
+    const Options&            opts;
+    std::vector<Chunk>        chunks;
+    std::mutex                mtx;
+    std::condition_variable   cv;
+    std::vector<std::jthread> workers;
+    U64                       next_chunk = 0;
+    U64                       window     = 0;
+    bool                      stop       = false;
+
+    /// Tokens and characters in the chunks lexed so far.
+    std::atomic<U64> lexed_tokens = 0;
+    std::atomic<U64> lexed_chars  = 0;
+
+    /// Position of the parser.
+    U64  chunk       = 0;
+    U64  index       = 0;
+    bool chunk_ready = false;
+
+    void Lex(Chunk& c, U32 last);
+    void Work();
+
+public:
+    String text;
+
+    /// Read and decode a file and start lexing it.
+    SpeculativeLexer(const Options& opts, const std::string& path, U64 threads);
+    ~SpeculativeLexer();
+
+    /// Use tokens that have already been lexed. \p end is the offset
+    /// of the end of the file.
+    SpeculativeLexer(const Options& opts, NodeList tokens, U32 end);
+
+    /// Take the token that starts at \p offset, if there is one, and
+    /// return the offset of the token after it. Offsets must increase.
+    auto Take(U32 offset, Node& token) -> std::optional<U32>;
+
+    /// Estimate how many tokens \p chars characters of the text contain
+    /// from the chunks lexed so far.
+    auto EstimateTokens(U64 chars) const -> U64;
+};
+
 struct Macro {
     NodeList              replacement;
     std::vector<NodeList> delimiters;
 
+    /// The text of the replacement and where it starts, if it hasn't
+    /// been lexed yet. See Parser::ParseDefinitionBody().
+    std::optional<String> source;
+    Location              source_loc;
+
+    /// Where the macro was defined, and whether it has been expanded.
+    Location loc;
+    bool     used = false;
+
     Macro() = default;
     Macro(NodeList replacement);
     Macro(std::vector<NodeList> delimiters, NodeList replacement);
 };
 
-namespace cl = command_line_options;
+/// Macro definitions. A definition made in a group, or removed with
+/// \Undef, is undone when the group ends: the previous definition of a
+/// macro is saved the first time it changes in a group and restored
+/// when the group ends, so leaving a group only costs as much as the
+/// changes made in it.
+class MacroTable {
+    struct Entry {
+        Macro macro;
+
+        /// Depth of the group in which the previous definition was saved.
+        U64 saved_at;
+    };
+
+    struct Saved {
+        String               name;
+        std::optional<Entry> entry;
+    };
+
+    /// A change to the table: the entry of a macro before it was
+    /// changed, or, if \c used is set, only that it was first used.
+    struct Change {
+        String               name;
+        std::optional<Entry> entry;
+        bool                 used = false;
+    };
+
+    std::unordered_map<String, Entry> table;
+    std::vector<Saved>                undo_log;
+    std::vector<Change>               history;
+    bool                              keep_history = false;
+
+    /// Size of the undo log when each open group was entered.
+    std::vector<U64> groups;
+
+    void Replace(const String& name, std::optional<Entry> entry);
+    void Save(const String& name);
+
+public:
+    bool Contains(const String& name) const { return table.contains(name); }
+
+    /// Get a macro, or nullptr if it isn't defined.
+    auto Find(const String& name) -> Macro*;
+
+    /// Get a macro and mark it as used, or nullptr if it isn't defined.
+    auto Use(const String& name) -> Macro*;
+
+    void Define(const String& name, Macro macro);
+    void Undefine(const String& name);
+
+    void EnterGroup() { groups.push_back(undo_log.size()); }
+    void LeaveGroup();
+
+    /// Record every change from now on so that it can be undone by
+    /// Rewind(). Used in --watch mode.
+    void KeepHistory() { keep_history = true; }
+
+    /// Undo every change made since Checkpoint() returned \p checkpoint.
+    /// Checkpoints can only be taken outside of groups.
+    auto Checkpoint() const -> U64 { return history.size(); }
+    void Rewind(U64 checkpoint);
+
+    /// Call \p f with the name of every macro that is currently defined and the macro.
+    template <typename Callable>
+    void ForEach(Callable f) {
+        for (auto& [name, e] : table) f(name, e.macro);
+    }
+};
+
+/// Files that \IncludeOnce won't include again: every file that has been
+/// included, by canonical path, and the content hash of every file that
+/// has been included with \IncludeOnce, so copies of a file are skipped too.
+struct IncludeGuard {
+    std::set<std::filesystem::path> paths;
+    std::set<U64>                   hashes;
+
+    /// Paths and hashes in the order they were added; see Rewind().
+    std::vector<std::filesystem::path> path_order;
+    std::vector<U64>                   hash_order;
+
+    /// Add a path or a hash. Returns false if it is already present.
+    bool AddPath(const std::filesystem::path& path);
+    bool AddHash(U64 hash);
+
+    /// Remove everything but the first \p path_count paths and \p hash_count hashes.
+    void Rewind(U64 path_count, U64 hash_count);
+};
+
+/// A conditional whose enabled branch the parser is in.
+struct OpenConditional {
+    Location loc;
+    U64      group_count;
+};
+
+/// State kept between runs in --watch mode.
+struct WatchSession {
+    /// Parser state at the end of the last run. Taking a snapshot
+    /// doesn't copy this; instead, it is rewound to the snapshot.
+    struct State {
+        SourceMap        sources;
+        MacroTable       macros;
+        ReplacementRules rep_rules;
+        ReplacementRules raw_rep_rules;
+        RegexReplacer    regex_rules;
+        IncludeGuard     include_guard;
+    };
+
+    /// Parser state right before a top-level \Include outside of any
+    /// group: how much of each part of the state existed at that point,
+    /// the file and offset of every open file, and the parts of the state
+    /// that are small enough to copy.
+    struct Snapshot {
+        U64                              include_index;
+        U64                              token_count;
+        U64                              dependency_count;
+        U64                              source_count;
+        U64                              macro_checkpoint;
+        U64                              rule_count;
+        U64                              raw_rule_count;
+        U64                              regex_rule_count;
+        U64                              included_path_count;
+        U64                              included_hash_count;
+        std::vector<std::pair<U32, U32>> open_files;
+        Char                             lastc;
+        bool                             at_eof;
+        std::vector<OpenConditional>     conditionals;
+        std::queue<Node>                 lookahead_queue;
+        Node                             token;
+    };
+
+    /// Every file included during the last run, in order.
+    std::vector<std::string> includes;
+    std::vector<Snapshot>    snapshots;
+    std::vector<std::string> dependencies;
+    NodeList                 tokens;
+
+    /// Only set if the last run got as far as the end of the input.
+    std::optional<State> state;
+
+    /// Snapshot to resume from in the next run, if any.
+    std::optional<U64> resume;
+
+    /// Determine where to resume given the set of changed files.
+    void ResumePoint(const std::set<std::filesystem::path>& changed);
+};
+
+/// Outputs of a run that produces several at once; see Parser::ProcessAll().
+struct RunOutputs {
+    std::optional<std::string> preprocessed;
+    std::optional<std::string> formatted;
+    std::optional<WordCount>   word_count;
+};
+
 struct Parser : public AbstractLexer {
-    using options = cl::clopts<
-        cl::positional<"file", "The file to process", std::string>,
-        cl::option<"-o", "The file to output to">,
-        cl::option<"--line-width", "The maximum line width", I64>,
-        cl::multiple<cl::option<"--enumerate-env", "Define an environment to be indented like enumerate">>,
-        cl::flag<"--print-tokens", "Print all tokens to stdout and exit">,
-        cl::flag<"--wc", "Count the number of characters and words in the file">,
-        cl::flag<"--format", "Format a file instead of preprocessing it">,
-        cl::help>;
-
-    FILE*                   output_file;
-    std::map<String, Macro> macros;
-    ReplacementRules        rep_rules;
-    ReplacementRules        raw_rep_rules;
-    NodeList                tokens;
-    U64                     group_count = 0;
-    U64                     line_width = 100;
-    std::queue<Node>        lookahead_queue;
-    String                  processed_text;
-
-    explicit Parser();
+    /// How the main file is read.
+    enum struct InputKind {
+        File,
+        Stream,
+        TokenDump,
+        Parallel,
+    };
+
+    /// What ended a disabled branch of a conditional.
+    enum struct ConditionalEnd {
+        Else,
+        EndIf,
+        EndOfGroup,
+        EndOfFile,
+    };
+
+    /// A file that is currently being read.
+    struct OpenFile {
+        U32 file;
+        U32 offset;
+        U32 length;
+
+        /// Contents of an included file. The main file is read
+        /// from input_text or the stream instead.
+        String text{};
+    };
+
+    /// Tokens read from a binary token dump instead of being lexed.
+    struct Replay {
+        TokenDump                          dump;
+        std::vector<U32>                   files;
+        std::vector<std::optional<String>> strings;
+        U64                                index = 0;
+
+        explicit Replay(const std::string& path) : dump(path) {}
+    };
+
+    const Options&                     opts;
+    MacroTable                         macros;
+    std::unique_ptr<ChunkedReader>     stream;
+    std::unique_ptr<SpeculativeLexer>  speculative;
+    String                             main_text;
+    const String*                      input_text = nullptr;
+
+    /// This scans the input text, so it must be destroyed first.
+    std::unique_ptr<IncludePrefetcher> prefetcher;
+
+    WatchSession*                      watch        = nullptr;
+    MacroProfiler*                     profiler     = nullptr;
+    const FormatRules*                 format_rules = nullptr;
+    std::vector<std::string>           dependencies;
+    std::vector<std::string>           diagnostics;
+    ReplacementRules                   rep_rules;
+    ReplacementRules                   raw_rep_rules;
+    RegexReplacer                      regex_rules;
+    NodeList                           tokens;
+    U64                                group_count = 0;
+    std::queue<Node>                   lookahead_queue;
+    String                             processed_text;
+    U64                                parse_depth = 0;
+    SourceMap                          sources;
+    std::vector<OpenFile>              open_files;
+    std::unique_ptr<Replay>            replay;
+    std::vector<OpenConditional>       conditionals;
+    IncludeGuard                       include_guard;
+    bool                               parsed = false;
+
+    Parser(const std::string& path, const Options& opts);
+    Parser(const std::string& path, const Options& opts, InputKind kind);
+
+    /// Lex \p text starting at \p begin; used by SpeculativeLexer.
+    Parser(const Options& opts, const String& text, U32 begin);
+
+    /// Process an input that is already in memory and decompressed. \p name
+    /// is used in diagnostics and as the first dependency.
+    Parser(const std::string& name, const Options& opts, std::string_view input);
+
+    /// Parse a file whose contents have already been decoded and lexed.
+    Parser(const std::string& path, const Options& opts, const String& text, NodeList tokens);
+
+    /// In --watch mode, hands the parser state over to the session
+    /// if the input was parsed without errors.
+    ~Parser();
+
+    /// Process the input. These can only be called once per parser.
+    auto CountWords() -> WordCount;
+    auto Format() -> std::string;
+
+    /// Check whether formatting the file wouldn't change it. \p input
+    /// is its contents. Stops formatting at the first line that differs.
+    auto CheckFormat(std::string_view input) -> bool;
+    auto Preprocess() -> std::string;
+    auto PrintTokens() -> std::string;
+
+    /// Lex a file once and produce several outputs from it concurrently.
+    static auto ProcessAll(const std::string& path, const Options& opts, bool preprocess, bool format, bool count_words) -> RunOutputs;
+
+    /// Write the tokens as a binary token dump (see token_dump.h).
+    auto DumpTokens() -> std::string;
 
     void ApplyReplacementRules(String& str);
     void ApplyRawReplacementRules();
     auto AsTextNode(const NodeList& lst) -> String;
     void ConstructText(NodeList& nodes);
-    void Emit();
+    auto Emit() -> std::string;
+    auto EmitParallel() -> std::string;
+    void Error(Location where, const char* fmt, ...);
     void Expect(TokenType type);
-    void Format();
+    [[noreturn]] void Fatal(Location where, const char* fmt, ...);
+    void FormatLines(const std::function<bool(std::string_view)>& emit);
     void HandleDefine();
     void HandleDefun();
+    void HandleElse();
+    void HandleEndIf();
     void HandleEval();
+    void HandleIfDefined();
+    void HandleInclude(bool once);
     void HandleMacroExpansion();
     void HandleReplace();
+    void HandleReplaceRegex();
+    auto Here() const -> Location;
+    bool IncludedBefore(const std::string& path, bool once, std::optional<std::string>& contents);
+    void IncludeFile(const std::string& path, std::string_view contents);
     void LexCommandSequence();
     void LexLineComment();
     void LexMacroArg();
+    auto LexMacroSource(const String& text, Location loc) -> NodeList;
     void LexText();
+    void NextChar();
     void NextNonWhitespaceToken();
     void NextToken() override;
+    void OpenMainFile(const std::string& path, std::string_view contents);
     void Parse();
-    void ParseCommandSequence();
+    auto ParseAndEmitPipelined() -> std::string;
+    bool ParseCommandSequence();
+    void ParseDefinitionBody(Macro& macro);
     auto ParseGroup(bool keep_closing_brace = false) -> NodeList;
+    auto ParseGroupContents(Location here, bool keep_closing_brace) -> NodeList;
     auto ParseMacroArgs() -> std::vector<NodeList>;
-    void ParseSequence();
+    bool ParseSequence();
     void ProcessReplacement(NodeList& lst);
     void ProcessReplacementRules();
-    void PushLookahead(const Node& node);
+    void PushLookahead(const Node& node, U32 profiler_frame = 0);
+    void RecordInclude(const std::string& path);
+    void ReplayFrom(const std::string& path);
+    void ReplayToken();
+    auto ReadBalancedGroup() -> String;
+    auto ReadInclude(const std::string& path) -> std::optional<std::string>;
+
+    /// Get the replacement of a macro, lexing it if that hasn't happened yet.
+    auto Replacement(Macro& macro) -> const NodeList&;
     auto ReplaceReadUntilBrace() -> String;
+    void ResumeFrom(U64 snapshot);
     void SkipCharsUntilIfWhitespace(Char c);
+    auto SkipConditional() -> ConditionalEnd;
+    bool ShouldEmitInParallel() const;
+    void SkipTo(U32 offset);
+    void Start();
+    void ThrowIfError();
+
+    /// Describe the macros that are still defined at the end of the
+    /// input but were never expanded, in the order they were defined.
+    auto UnusedMacros() -> std::vector<std::string>;
 
-    static auto FormatPass1(NodeList&& tokens, U64 line_width) -> std::string;
-    static auto FormatPass2(std::string&& text, std::vector<std::string> enumerate_envs) -> std::vector<std::string>;
+    static bool AppendNodeText(String& text, const Node& node);
+    static void ApplyReplacementRules(String& str, const std::vector<std::pair<String, String>>& rules);
+    static auto Classify(const std::string& path, const Options& opts) -> InputKind;
+    static void CountToken(WordCount& wc, const Node& token);
+
+    /// Get the length of the longest prefix of \p input that is valid UTF-8
+    /// and contains no directives or lexer errors. Preprocessing the input
+    /// reproduces it byte for byte iff that is all of it.
+    static auto PassThroughPrefix(std::string_view input) -> U64;
+    static auto FormatPass1(const AST& ast, U64 line_width, const FormatRules& rules) -> std::string;
+    static void FormatPass2(std::string_view text, const FormatRules& rules, const std::function<bool(std::string_view)>& emit);
+    static void FormatTokens(NodeList tokens, const Options& opts, const FormatRules* rules, const std::function<bool(std::string_view)>& emit);
     static void MergeTextNodes(NodeList& lst, bool merge_whitespace = true);
     static auto TokenTypeToString(TokenType type) -> std::string;
 };
 
+/// Check whether \p name, without the backslash, is a directive.
+bool IsDirective(std::string_view name);
+bool IsLetter(Char c);
+bool IsSpace(U32 c);
+
+/// Decode UTF-8, appending the result to \p out. Invalid sequences
+/// are replaced with U+FFFD.
+void DecodeUTF8(std::string_view bytes, String& out);
+
+/// Read a file, decompressing it if it is compressed. Returns nullopt
+/// and sets errno if it can't be read.
+auto ReadInput(const std::string& path) -> std::optional<std::string>;
+auto NormalisePath(const std::string& path) -> std::filesystem::path;
 String StringiseType(const Node& token);
 
 } // namespace TeX
@@ -0,0 +1,109 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace TeX {
+namespace {
+/// Commands that ParseCommandSequence() handles, without the backslash.
+constexpr std::array<std::string_view, 9> directives{
+    "Define",
+    "Undef",
+    "Replace",
+    "ReplaceRegex",
+    "IfDefined",
+    "Else",
+    "EndIf",
+    "Include",
+    "IncludeOnce",
+};
+
+constexpr U64 ones = ~U64(0) / 255;
+
+/// Check whether any byte of \p word is \p byte.
+constexpr bool HasByte(U64 word, U8 byte) {
+    auto x = word ^ (ones * byte);
+    return (x - ones) & ~x & (ones * 0x80);
+}
+
+/// Get the length of the valid UTF-8 sequence at the start of \p s,
+/// or 0 if it's invalid. Overlong sequences and surrogates are invalid,
+/// since decoding them wouldn't give back the same bytes.
+auto UTF8SequenceLength(std::string_view s) -> U64 {
+    auto lead = U8(s[0]);
+    U64  len  = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC2 ? 2 : 0;
+    if (len == 0 || lead > 0xF4 || s.size() < len) return 0;
+
+    Char c = lead & (0x7F >> len);
+    for (U64 i = 1; i < len; i++) {
+        if ((U8(s[i]) & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (U8(s[i]) & 0x3F);
+    }
+
+    if ((len == 3 && c < 0x800) || (len == 4 && (c < 0x10000 || c > 0x10FFFF))) return 0;
+    if (c >= 0xD800 && c <= 0xDFFF) return 0;
+    return len;
+}
+} // namespace
+
+bool IsDirective(std::string_view name) {
+    return std::find(directives.begin(), directives.end(), name) != directives.end();
+}
+
+/// The input is scanned eight bytes at a time as long as they're plain
+/// ASCII other than '\' and '#', which is most of a typical file.
+auto Parser::PassThroughPrefix(std::string_view input) -> U64 {
+    for (U64 pos = 0; pos < input.size();) {
+        if (pos + sizeof(U64) <= input.size()) {
+            U64 word;
+            std::memcpy(&word, input.data() + pos, sizeof word);
+            if (!(word & (ones * 0x80)) && !HasByte(word, '\\') && !HasByte(word, '#') && !HasByte(word, 0)) {
+                pos += sizeof word;
+                continue;
+            }
+        }
+
+        switch (auto c = U8(input[pos])) {
+            /// A fresh parser has no macros or replacement rules,
+            /// so only directives change the output.
+            case '\\': {
+                auto end = pos + 1;
+                while (end < input.size() && IsLetter(Char(input[end]))) end++;
+                if (end == input.size() && end == pos + 1) return pos; /// Dangling backslash.
+
+                /// Skip the character after a backslash, e.g. in '\#', unless
+                /// it's not ASCII, in which case it still needs to be checked.
+                if (end == pos + 1) {
+                    pos += U8(input[end]) < 0x80 ? 2 : 1;
+                    break;
+                }
+
+                auto name = input.substr(pos + 1, end - pos - 1);
+                if (IsDirective(name)) return pos;
+                pos = end;
+            } break;
+
+            /// Anything other than a valid macro argument is an error.
+            case '#': {
+                auto digit = pos + 1 < input.size() && input[pos + 1] == '#' ? pos + 2 : pos + 1;
+                if (digit >= input.size() || input[digit] < '1' || input[digit] > '9') return pos;
+                pos = digit + 1;
+            } break;
+
+            case 0: return pos;
+
+            default:
+                if (c < 0x80) {
+                    pos++;
+                    break;
+                }
+
+                auto len = UTF8SequenceLength(input.substr(pos));
+                if (len == 0) return pos;
+                pos += len;
+        }
+    }
+    return input.size();
+}
+} // namespace TeX
@@ -0,0 +1,37 @@
+#ifndef XPP_PHASE_H
+#define XPP_PHASE_H
+
+#include <cstdint>
+
+namespace TeX {
+/// The processing phases that allocation statistics are broken down by
+/// (see tests/alloc_stats.cc). Phases nest; allocations are attributed to the
+/// innermost one.
+enum struct Phase : std::uint8_t {
+    Other,
+    Parse,
+    MergeTextNodes,
+    HandleMacroExpansion,
+    Emit,
+    FormatPass1,
+    FormatPass2,
+    Count,
+};
+
+/// The phase that the current thread is in.
+inline thread_local Phase current_phase = Phase::Other;
+
+/// Enter a phase for the lifetime of this object.
+class PhaseScope {
+    Phase saved;
+
+public:
+    explicit PhaseScope(Phase phase) : saved(current_phase) { current_phase = phase; }
+    ~PhaseScope() { current_phase = saved; }
+
+    PhaseScope(const PhaseScope&)            = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+};
+} // namespace TeX
+
+#endif // XPP_PHASE_H
@@ -0,0 +1,178 @@
+#include "parser.h"
+#include "spsc_queue.h"
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+namespace TeX {
+/// Number of tokens per batch passed between pipeline stages.
+constexpr U64 pipeline_batch_size = 4096;
+
+/// Number of batches that may be in flight between two stages.
+constexpr U64 pipeline_queue_size = 64;
+
+using BatchQueue = SPSCQueue<std::unique_ptr<TokenBatch>, pipeline_queue_size>;
+
+bool IsMergeable(const Node& node) {
+    return node.type == TokenType::Text || node.type == TokenType::Whitespace;
+}
+
+/// Apply replacement rules to and construct the text of a batch.
+void EmitBatch(TokenBatch& batch, const std::vector<std::pair<String, String>>& rules, bool encode) {
+    batch.text.clear();
+    batch.utf8.clear();
+    for (const auto& node : batch.nodes) {
+        if (node.type == TokenType::Text && !rules.empty()) {
+            String s = node.string_content;
+            Parser::ApplyReplacementRules(s, rules);
+            batch.text += s;
+        } else Parser::AppendNodeText(batch.text, node);
+    }
+
+    /// Raw replacement rules operate on the entire text, so we
+    /// can only encode the text now if there are none.
+    if (encode) batch.utf8 = ToUTF8(batch.text);
+}
+
+/// Parse the input and emit it in three concurrent stages:
+///
+///   1. Lexing, macro expansion and directive handling (this thread).
+///      These can't be separated since directives such as \Replace*
+///      and \Include operate on the raw character stream.
+///   2. Merging text nodes.
+///   3. Applying replacement rules, constructing the text, and encoding it.
+///
+/// Replacement rules apply to the entire document, even to text that
+/// precedes their definition, so stage 3 works with the rules known at the
+/// time a batch was parsed; any batch whose rules turn out to be out of date
+/// once parsing is complete is processed again.
+auto Parser::ParseAndEmitPipelined() -> std::string {
+    BatchQueue                               parsed;
+    BatchQueue                               merged;
+    std::vector<std::unique_ptr<TokenBatch>> emitted;
+
+    /// Stage 2: Merge text nodes. A trailing run of text nodes is carried
+    /// over into the next batch so that we merge across batch boundaries.
+    std::thread merge_stage{[&] {
+        NodeList carry;
+        bool     eof_seen = false;
+        for (;;) {
+            auto       batch = parsed.Pop();
+            const bool last  = batch->last;
+            if (eof_seen) batch->nodes.clear();
+            else {
+                /// Nothing after the end of the file is emitted.
+                auto eof = std::find_if(batch->nodes.begin(), batch->nodes.end(), [](const Node& node) {
+                    return node.type == TokenType::EndOfFile;
+                });
+                if (eof != batch->nodes.end()) {
+                    batch->nodes.erase(eof, batch->nodes.end());
+                    eof_seen = true;
+                }
+
+                carry.insert(carry.end(), std::make_move_iterator(batch->nodes.begin()), std::make_move_iterator(batch->nodes.end()));
+                batch->nodes = std::move(carry);
+                carry.clear();
+
+                if (!last && !eof_seen) {
+                    auto it = batch->nodes.end();
+                    while (it != batch->nodes.begin() && IsMergeable(*(it - 1))) --it;
+                    carry.assign(std::make_move_iterator(it), std::make_move_iterator(batch->nodes.end()));
+                    batch->nodes.erase(it, batch->nodes.end());
+                }
+
+                MergeTextNodes(batch->nodes);
+            }
+            merged.Push(std::move(batch));
+            if (last) break;
+        }
+    }};
+
+    /// Stage 3: Replacement, text construction, and encoding.
+    std::thread emit_stage{[&] {
+        PhaseScope phase{Phase::Emit};
+        for (;;) {
+            auto       batch = merged.Pop();
+            const bool last  = batch->last;
+            EmitBatch(*batch, batch->rules->rules, !batch->rules->has_raw_rules);
+            emitted.push_back(std::move(batch));
+            if (last) break;
+        }
+    }};
+
+    /// Stage 1: Parse the input.
+    auto snapshot       = std::make_shared<const RuleSnapshot>();
+    U64  rule_count     = 0;
+    U64  raw_rule_count = 0;
+    auto batch          = std::make_unique<TokenBatch>();
+    auto Publish        = [&](bool last) {
+        /// Take a new snapshot of the rules if they've changed.
+        auto raw_rules = raw_rep_rules.processed.size() + regex_rules.size();
+        if (rep_rules.rules.size() != rule_count || raw_rules != raw_rule_count) {
+            rule_count     = rep_rules.rules.size();
+            raw_rule_count = raw_rules;
+            auto s         = std::make_shared<RuleSnapshot>();
+            for (const auto& [text, replacement] : rep_rules.rules)
+                s->rules.emplace_back(AsTextNode(text), AsTextNode(replacement));
+            s->has_raw_rules = raw_rule_count != 0;
+            snapshot         = std::move(s);
+        }
+
+        batch->rules = snapshot;
+        batch->last  = last;
+        parsed.Push(std::move(batch));
+        if (!last) {
+            batch = std::make_unique<TokenBatch>();
+            batch->nodes.reserve(pipeline_batch_size);
+        }
+    };
+
+    /// If parsing fails, we still need to shut down the other stages.
+    std::exception_ptr error;
+    try {
+        PhaseScope phase{Phase::Parse};
+        batch->nodes.reserve(pipeline_batch_size);
+        do {
+            if (ParseSequence()) continue;
+            batch->nodes.push_back(token);
+            NextToken();
+            if (batch->nodes.size() == pipeline_batch_size) Publish(false);
+        } while (token.type != T::EndOfFile);
+        for (const auto& c : conditionals) Error(c.loc, "Unterminated \\IfDefined");
+        Publish(true);
+    } catch (...) {
+        error = std::current_exception();
+        if (!batch) batch = std::make_unique<TokenBatch>();
+        batch->rules = snapshot;
+        batch->last  = true;
+        parsed.Push(std::move(batch));
+    }
+
+    merge_stage.join();
+    emit_stage.join();
+    if (error) std::rethrow_exception(error);
+    ThrowIfError();
+
+    /// Now that all rules are known, fix up any batches that
+    /// were processed with an outdated set of rules.
+    ProcessReplacementRules();
+    const bool encode = raw_rep_rules.processed.empty() && regex_rules.empty();
+    for (auto& b : emitted)
+        if (b->rules->rules != rep_rules.processed) EmitBatch(*b, rep_rules.processed, encode);
+
+    if (encode) {
+        U64 size = 0;
+        for (const auto& b : emitted) size += b->utf8.size();
+
+        std::string out;
+        out.reserve(size);
+        for (const auto& b : emitted) out += b->utf8;
+        return out;
+    }
+
+    for (const auto& b : emitted) processed_text += b->text;
+    ApplyRawReplacementRules();
+    return ToUTF8(processed_text);
+}
+} // namespace TeX
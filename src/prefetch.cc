@@ -0,0 +1,135 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace TeX {
+/// Reading files is I/O-bound, so we don't need to match the number of cores.
+constexpr U64 prefetch_threads = 4;
+
+IncludePrefetcher::IncludePrefetcher(const String& main_text) {
+    for (U64 i = 0; i < prefetch_threads; i++) workers.emplace_back([this] { Work(); });
+
+    /// The main file has already been read, so only scan it; this
+    /// happens in the background too so the parser can start right away.
+    workers.emplace_back([this, &main_text] {
+        for (auto& include : ScanIncludes(std::u32string_view{main_text})) Enqueue(std::move(include));
+    });
+}
+
+IncludePrefetcher::~IncludePrefetcher() {
+    {
+        std::unique_lock lock{mtx};
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+auto IncludePrefetcher::Claim(const std::string& path) -> std::optional<std::string> {
+    std::unique_lock lock{mtx};
+
+    /// Mark the file as done even if it isn't known yet so that
+    /// no worker reads it after the parser already has.
+    auto& f = files[path];
+    if (f.state == State::Reading) cv.wait(lock, [&] { return f.state == State::Done; });
+    f.state = State::Done;
+    return std::exchange(f.contents, std::nullopt);
+}
+
+void IncludePrefetcher::Enqueue(std::string path) {
+    {
+        std::unique_lock lock{mtx};
+        if (stop || files.contains(path)) return;
+        files[path] = {};
+        queue.push_back(std::move(path));
+    }
+    cv.notify_one();
+}
+
+void IncludePrefetcher::Work() {
+    for (;;) {
+        std::string path;
+        {
+            std::unique_lock lock{mtx};
+            cv.wait(lock, [&] { return stop || !queue.empty(); });
+            if (stop) return;
+            path = std::move(queue.front());
+            queue.pop_front();
+
+            /// Skip files that the parser has claimed in the meantime.
+            if (files[path].state != State::Queued) continue;
+            files[path].state = State::Reading;
+        }
+
+        auto                     contents = ReadInput(path);
+        std::vector<std::string> includes;
+        if (contents) includes = ScanIncludes(std::string_view{*contents});
+
+        {
+            std::unique_lock lock{mtx};
+            files[path] = {State::Done, std::move(contents)};
+        }
+        cv.notify_all();
+
+        for (auto& include : includes) Enqueue(std::move(include));
+    }
+}
+
+/// Convert the text of a path to UTF-8.
+static auto PathToUTF8(std::string_view path) -> std::string { return std::string{path}; }
+static auto PathToUTF8(std::u32string_view path) -> std::string { return ToUTF8(String{path}); }
+
+/// Check whether \p text starts with the ASCII string \p prefix.
+template <typename CharType>
+static bool StartsWith(std::basic_string_view<CharType> text, std::string_view prefix) {
+    return text.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), text.begin(), [](char a, CharType b) {
+               return CharType(a) == b;
+           });
+}
+
+template <typename CharType>
+auto IncludePrefetcher::ScanIncludes(std::basic_string_view<CharType> text) -> std::vector<std::string> {
+    static constexpr std::string_view include      = "\\Include";
+    static constexpr CharType         delimiters[] = {'{', '}', '\\', '%', 0};
+    std::vector<std::string>          paths;
+    for (U64 pos = 0; pos < text.size(); pos++) {
+        switch (text[pos]) {
+            /// Skip comments.
+            case '%':
+                pos = text.find(CharType('\n'), pos);
+                if (pos == text.npos) return paths;
+                continue;
+
+            case '\\': {
+                if (!StartsWith(text.substr(pos), include)) {
+                    pos++; /// Skip escaped character.
+                    continue;
+                }
+
+                pos += include.size();
+                if (StartsWith(text.substr(pos), "Once")) pos += 4;
+                if (pos < text.size() && IsLetter(Char(text[pos]))) continue;
+                while (pos < text.size() && IsSpace(U32(text[pos]))) pos++;
+                if (pos == text.size() || text[pos] != '{') continue;
+
+                /// Only literal paths can be prefetched.
+                auto end = text.find_first_of(delimiters, ++pos);
+                if (end == text.npos) return paths;
+                if (text[end] != '}') {
+                    pos = end - 1;
+                    continue;
+                }
+
+                auto path = Trim(PathToUTF8(text.substr(pos, end - pos)));
+                if (!path.empty()) paths.push_back(std::move(path));
+                pos = end;
+                continue;
+            }
+
+            default: continue;
+        }
+    }
+    return paths;
+}
+} // namespace TeX
@@ -0,0 +1,168 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace TeX {
+namespace {
+using Micros = std::chrono::duration<double, std::micro>;
+using Millis = std::chrono::duration<double, std::milli>;
+
+/// Visit the frames depth-first; \p pre is called when a frame is entered
+/// and \p post when it's left. This is iterative since call chains of
+/// recursive macros can be very deep.
+template <typename Frame, typename Pre, typename Post>
+void Walk(const std::vector<Frame>& frames, Pre pre, Post post) {
+    std::vector<std::pair<U32, bool>> stack{{0, false}};
+    while (!stack.empty()) {
+        auto [frame, leaving] = stack.back();
+        stack.pop_back();
+        if (leaving) {
+            post(frame);
+            continue;
+        }
+
+        pre(frame);
+        stack.emplace_back(frame, true);
+        for (auto [_, child] : frames[frame].children) stack.emplace_back(child, false);
+    }
+}
+} // namespace
+
+MacroProfiler::MacroProfiler() : last(Clock::now()) {
+    frames.push_back({.name = U"document"});
+}
+
+void MacroProfiler::Charge() {
+    auto now             = Clock::now();
+    frames[current].self += now - last;
+    last                 = now;
+}
+
+void MacroProfiler::Switch(U32 frame) {
+    token_frame = frame;
+    if (scanning_args || frame == current) return;
+    Charge();
+    current = frame;
+}
+
+auto MacroProfiler::BeginExpansion(const String& name) -> U32 {
+    Charge();
+    auto [it, inserted] = frames[token_frame].children.try_emplace(name, U32(frames.size()));
+    auto frame          = it->second;
+    if (inserted) frames.push_back({.parent = token_frame, .name = name});
+
+    frames[frame].expansions++;
+    scanning_args = true;
+    args_start    = last;
+    return frame;
+}
+
+void MacroProfiler::EndArguments(U32 frame) {
+    auto now           = Clock::now();
+    frames[frame].args += now - args_start;
+    frames[frame].self += now - args_start;
+    last               = now;
+    scanning_args      = false;
+    current            = token_frame;
+}
+
+auto MacroProfiler::Report() const -> std::string {
+    struct Stats {
+        String          name;
+        U64             expansions{};
+        U64             tokens{};
+        Clock::duration args{};
+        Clock::duration self{};
+        Clock::duration total{};
+    };
+
+    /// Frames are created after their parents, so we can sum up
+    /// the inclusive time of each frame back to front.
+    std::vector<Clock::duration> inclusive(frames.size());
+    for (U64 i = frames.size(); i-- > 0;) {
+        inclusive[i] += frames[i].self;
+        if (i) inclusive[frames[i].parent] += inclusive[i];
+    }
+
+    /// Only count the inclusive time of the outermost expansion of
+    /// a recursive macro, or we'd count the same time several times.
+    std::map<String, Stats> macros;
+    std::map<String, U32>   active;
+    Walk(
+        frames,
+        [&](U32 i) {
+            if (i == 0) return;
+            const auto& f = frames[i];
+            auto&       s = macros[f.name];
+            s.expansions  += f.expansions;
+            s.tokens      += f.tokens;
+            s.args        += f.args;
+            s.self        += f.self;
+            if (active[f.name]++ == 0) s.total += inclusive[i];
+        },
+        [&](U32 i) {
+            if (i) active[frames[i].name]--;
+        }
+    );
+
+    std::vector<Stats> sorted;
+    for (auto& [name, s] : macros) {
+        s.name = name;
+        sorted.push_back(std::move(s));
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const Stats& a, const Stats& b) { return a.self > b.self; });
+
+    std::string out;
+    char        buffer[256];
+    std::snprintf(buffer, sizeof buffer, "%12s %12s %12s %12s %12s  %s\n", "Expansions", "Tokens", "Args (ms)", "Self (ms)", "Total (ms)", "Macro");
+    out += buffer;
+    for (const auto& s : sorted) {
+        std::snprintf(
+            buffer,
+            sizeof buffer,
+            "%12zu %12zu %12.3f %12.3f %12.3f  ",
+            s.expansions,
+            s.tokens,
+            Millis(s.args).count(),
+            Millis(s.self).count(),
+            Millis(s.total).count()
+        );
+        out += buffer;
+        out += ToUTF8(s.name);
+        out += '\n';
+    }
+
+    std::snprintf(buffer, sizeof buffer, "\nTime outside of macros: %.3f ms\n", Millis(frames[0].self).count());
+    out += buffer;
+    return out;
+}
+
+auto MacroProfiler::FoldedStacks() const -> std::string {
+    std::string         out;
+    std::string         stack;
+    std::vector<size_t> lengths;
+    Walk(
+        frames,
+        [&](U32 i) {
+            lengths.push_back(stack.size());
+            if (i) stack += ';';
+
+            /// ';' and ' ' are separators in this format.
+            for (auto c : ToUTF8(frames[i].name)) stack += c == ';' || c == ' ' ? '_' : c;
+
+            auto us = U64(Micros(frames[i].self).count());
+            if (us == 0) return;
+            out += stack;
+            out += ' ';
+            out += std::to_string(us);
+            out += '\n';
+        },
+        [&](U32) {
+            stack.resize(lengths.back());
+            lengths.pop_back();
+        }
+    );
+    return out;
+}
+} // namespace TeX
@@ -0,0 +1,87 @@
+#ifndef XPP_PROFILER_H
+#define XPP_PROFILER_H
+
+#include <chrono>
+#include <map>
+#include <queue>
+#include <string>
+#include <utils/parser.h>
+#include <vector>
+
+namespace TeX {
+/// Records where time is spent expanding macros.
+///
+/// Macros aren't expanded recursively: an expansion pushes its replacement
+/// onto the parser's lookahead queue, and macros in it are expanded when
+/// the parser gets to them. The profiler therefore tags every queued token
+/// with the expansion that produced it; a macro expanded from such a token
+/// is a callee of that expansion, and the time spent on a token is charged
+/// to the expansion it came from. Expansions are aggregated by call chain.
+class MacroProfiler {
+    using Clock = std::chrono::steady_clock;
+
+    struct Frame {
+        U32                   parent{};
+        String                name;
+        U64                   expansions{};
+        U64                   tokens{};
+        Clock::duration       self{};
+        Clock::duration       args{};
+        std::map<String, U32> children{};
+    };
+
+    /// Frame 0 is the document itself.
+    std::vector<Frame> frames;
+
+    /// Frame of each token in the lookahead queue.
+    std::queue<U32> queued;
+
+    /// Frame of the current token, and frame that time is being charged to.
+    U32 token_frame = 0;
+    U32 current     = 0;
+
+    /// Whether we're reading the arguments of a macro.
+    bool scanning_args = false;
+
+    Clock::time_point last;
+    Clock::time_point args_start;
+
+    void Charge();
+    void Switch(U32 frame);
+
+public:
+    MacroProfiler();
+
+    /// Called by the parser for every token it reads.
+    void TokenFromInput() { Switch(0); }
+    void TokenFromQueue() {
+        auto frame = queued.front();
+        queued.pop();
+        Switch(frame);
+    }
+
+    /// Called when a token produced by an expansion is pushed onto the lookahead queue.
+    void Queued(U32 frame) {
+        queued.push(frame);
+        frames[frame].tokens++;
+    }
+
+    /// Start expanding a macro. Returns the frame that its replacement belongs to.
+    auto BeginExpansion(const String& name) -> U32;
+
+    /// Called once the arguments of the macro have been read.
+    void EndArguments(U32 frame);
+
+    /// Charge the time spent since the last token.
+    void Stop() { Charge(); }
+
+    /// A table of macros, sorted by exclusive time.
+    auto Report() const -> std::string;
+
+    /// The call chains in the folded format understood by flamegraph.pl,
+    /// one per line, with the exclusive time in microseconds.
+    auto FoldedStacks() const -> std::string;
+};
+} // namespace TeX
+
+#endif // XPP_PROFILER_H
@@ -0,0 +1,736 @@
+#include "regex.h"
+
+#include <algorithm>
+#include <cwctype>
+#include <deque>
+
+namespace TeX {
+namespace {
+using Op     = RegexReplacer::Op;
+using Inst   = RegexReplacer::Inst;
+using Ranges = RegexReplacer::Ranges;
+
+constexpr Char max_char  = 0x10FFFF;
+constexpr U32  unbounded = U32(-1);
+
+/// Maximum number of instructions per rule. This bounds the
+/// amount of work done per character of input.
+constexpr U64 max_rule_size = 10'000;
+
+/// Maximum count in a counted repetition.
+constexpr U32 max_repeat = 1'000;
+
+constexpr U64 no_match = U64(-1);
+
+struct RegexError {
+    std::string message;
+};
+
+struct RegexNode {
+    enum struct Kind : U8 {
+        Empty,
+        Char,
+        Any,
+        Class,
+        Concat,
+        Alternate,
+        Group,
+        Repeat,
+        Assertion,
+    };
+
+    Kind                   kind;
+    U32                    value  = 0;
+    U32                    min    = 0;
+    U32                    max    = 0;
+    bool                   greedy = true;
+    std::vector<RegexNode> children{};
+};
+
+using K = RegexNode::Kind;
+
+bool IsWordChar(Char c) {
+    if (c < 0x80) return (U'a' <= c && c <= U'z') || (U'A' <= c && c <= U'Z') || (U'0' <= c && c <= U'9') || c == U'_';
+    return std::iswalnum(std::wint_t(c));
+}
+
+/// Sort and merge overlapping ranges.
+void Normalise(Ranges& r) {
+    std::sort(r.begin(), r.end());
+    Ranges out;
+    for (const auto& [lo, hi] : r) {
+        if (!out.empty() && lo <= out.back().second + 1) out.back().second = std::max(out.back().second, hi);
+        else out.emplace_back(lo, hi);
+    }
+    r = std::move(out);
+}
+
+auto Complement(const Ranges& r) -> Ranges {
+    Ranges out;
+    Char   next = 0;
+    for (const auto& [lo, hi] : r) {
+        if (lo > next) out.emplace_back(next, lo - 1);
+        next = hi + 1;
+    }
+    if (next <= max_char) out.emplace_back(next, max_char);
+    return out;
+}
+
+bool Contains(const Ranges& r, Char c) {
+    auto it = std::upper_bound(r.begin(), r.end(), c, [](Char ch, const auto& range) { return ch < range.first; });
+    return it != r.begin() && c <= (it - 1)->second;
+}
+
+/// Recursive-descent parser for patterns.
+class RegexParser {
+    const String&        pattern;
+    std::vector<Ranges>& classes;
+    U64                  pos = 0;
+
+public:
+    U32 groups = 0;
+
+    RegexParser(const String& _pattern, std::vector<Ranges>& _classes) : pattern(_pattern), classes(_classes) {}
+
+    auto Parse() -> RegexNode {
+        auto node = ParseAlternation();
+        if (pos < pattern.size()) throw RegexError{"Unmatched ')' in regular expression"};
+        return node;
+    }
+
+private:
+    bool AtEnd() const { return pos >= pattern.size(); }
+    Char Peek() const { return pattern[pos]; }
+    bool Consume(Char c) {
+        if (AtEnd() || Peek() != c) return false;
+        pos++;
+        return true;
+    }
+
+    auto AddClass(Ranges r, bool negate) -> RegexNode {
+        Normalise(r);
+        classes.push_back(negate ? Complement(r) : std::move(r));
+        return {.kind = K::Class, .value = U32(classes.size() - 1)};
+    }
+
+    /// Ranges for \d, \w, \s and their negations. Returns false if \p c isn't one of them.
+    static bool ShorthandClass(Char c, Ranges& out) {
+        Ranges r;
+        switch (c) {
+            case U'd':
+            case U'D':
+                r = {{U'0', U'9'}};
+                break;
+            case U'w':
+            case U'W':
+                r = {{U'0', U'9'}, {U'A', U'Z'}, {U'_', U'_'}, {U'a', U'z'}};
+                break;
+            case U's':
+            case U'S':
+                r = {{U'\t', U'\r'}, {U' ', U' '}};
+                break;
+            default: return false;
+        }
+        if (c == U'D' || c == U'W' || c == U'S') r = Complement(r);
+        out.insert(out.end(), r.begin(), r.end());
+        return true;
+    }
+
+    /// Character denoted by an escape sequence that stands for a single character.
+    auto EscapedChar(Char c) -> Char {
+        switch (c) {
+            case U'n': return U'\n';
+            case U't': return U'\t';
+            case U'r': return U'\r';
+            default:
+                if ((U'0' <= c && c <= U'9')) throw RegexError{"Backreferences are not supported in regular expressions"};
+                if (IsWordChar(c)) throw RegexError{"Unknown escape sequence '\\" + ToUTF8(String(1, c)) + "' in regular expression"};
+                return c;
+        }
+    }
+
+    auto ParseAlternation() -> RegexNode {
+        auto first = ParseConcatenation();
+        if (AtEnd() || Peek() != U'|') return first;
+
+        RegexNode alt{.kind = K::Alternate};
+        alt.children.push_back(std::move(first));
+        while (Consume(U'|')) alt.children.push_back(ParseConcatenation());
+        return alt;
+    }
+
+    auto ParseConcatenation() -> RegexNode {
+        RegexNode cat{.kind = K::Concat};
+        while (!AtEnd() && Peek() != U'|' && Peek() != U')') cat.children.push_back(ParseRepetition());
+        if (cat.children.empty()) return {.kind = K::Empty};
+        if (cat.children.size() == 1) return std::move(cat.children.front());
+        return cat;
+    }
+
+    /// Parse '{n}', '{n,}' or '{n,m}'. If this isn't a valid count,
+    /// the '{' is a literal character and nothing is consumed.
+    bool ParseCount(U32& min, U32& max) {
+        auto start = pos;
+        auto Number = [&](U32& out) {
+            if (AtEnd() || Peek() < U'0' || Peek() > U'9') return false;
+            U64 n = 0;
+            while (!AtEnd() && U'0' <= Peek() && Peek() <= U'9') {
+                n = n * 10 + (Peek() - U'0');
+                if (n > max_repeat) throw RegexError{"Repetition count in regular expression exceeds " + std::to_string(max_repeat)};
+                pos++;
+            }
+            out = U32(n);
+            return true;
+        };
+
+        pos++; /// yeet '{'
+        if (!Number(min)) {
+            pos = start;
+            return false;
+        }
+
+        if (Consume(U',')) {
+            if (!Number(max)) max = unbounded;
+        } else max = min;
+
+        if (!Consume(U'}')) {
+            pos = start;
+            return false;
+        }
+
+        if (max < min) throw RegexError{"Invalid repetition count in regular expression"};
+        return true;
+    }
+
+    auto ParseRepetition() -> RegexNode {
+        auto atom = ParseAtom();
+        for (;;) {
+            if (AtEnd()) return atom;
+            U32 min, max;
+            switch (Peek()) {
+                case U'*':
+                    min = 0, max = unbounded;
+                    pos++;
+                    break;
+                case U'+':
+                    min = 1, max = unbounded;
+                    pos++;
+                    break;
+                case U'?':
+                    min = 0, max = 1;
+                    pos++;
+                    break;
+                case U'{':
+                    if (!ParseCount(min, max)) return atom;
+                    break;
+                default: return atom;
+            }
+
+            if (atom.kind == K::Assertion || atom.kind == K::Empty)
+                throw RegexError{"Quantifier without operand in regular expression"};
+
+            RegexNode rep{.kind = K::Repeat, .min = min, .max = max, .greedy = !Consume(U'?')};
+            rep.children.push_back(std::move(atom));
+            atom = std::move(rep);
+        }
+    }
+
+    auto ParseAtom() -> RegexNode {
+        Char c = pattern[pos++];
+        switch (c) {
+            case U'(': {
+                RegexNode group{.kind = K::Group};
+                if (Consume(U'?')) {
+                    if (!Consume(U':')) throw RegexError{"Unsupported group syntax in regular expression"};
+                    group.kind = K::Concat;
+                } else group.value = ++groups;
+
+                group.children.push_back(ParseAlternation());
+                if (!Consume(U')')) throw RegexError{"Unmatched '(' in regular expression"};
+                return group;
+            }
+
+            case U'[': return ParseClass();
+            case U'.': return {.kind = K::Any};
+            case U'^': return {.kind = K::Assertion, .value = U32(Op::LineStart)};
+            case U'$': return {.kind = K::Assertion, .value = U32(Op::LineEnd)};
+            case U'*':
+            case U'+':
+            case U'?':
+                throw RegexError{"Quantifier without operand in regular expression"};
+
+            case U'\\': {
+                if (AtEnd()) throw RegexError{"Dangling backslash at end of regular expression"};
+                c = pattern[pos++];
+                if (c == U'b') return {.kind = K::Assertion, .value = U32(Op::WordBoundary)};
+                if (c == U'B') return {.kind = K::Assertion, .value = U32(Op::NotWordBoundary)};
+
+                Ranges r;
+                if (ShorthandClass(c, r)) return AddClass(std::move(r), false);
+                return {.kind = K::Char, .value = U32(EscapedChar(c))};
+            }
+
+            default: return {.kind = K::Char, .value = U32(c)};
+        }
+    }
+
+    /// Parse a character class. The '[' has already been consumed.
+    auto ParseClass() -> RegexNode {
+        Ranges r;
+        bool   negate = Consume(U'^');
+        bool   first  = true;
+        for (;;) {
+            if (AtEnd()) throw RegexError{"Unterminated character class in regular expression"};
+            Char c = pattern[pos++];
+
+            /// A ']' at the start of a class is a literal character.
+            if (c == U']' && !first) break;
+            first = false;
+
+            if (c == U'\\') {
+                if (AtEnd()) throw RegexError{"Unterminated character class in regular expression"};
+                c = pattern[pos++];
+                if (ShorthandClass(c, r)) continue;
+                c = EscapedChar(c);
+            }
+
+            /// Range.
+            if (pos + 1 < pattern.size() && Peek() == U'-' && pattern[pos + 1] != U']') {
+                pos++; /// yeet '-'
+                Char hi = pattern[pos++];
+                if (hi == U'\\') {
+                    if (AtEnd()) throw RegexError{"Unterminated character class in regular expression"};
+                    hi = EscapedChar(pattern[pos++]);
+                }
+                if (hi < c) throw RegexError{"Invalid range in character class in regular expression"};
+                r.emplace_back(c, hi);
+            } else r.emplace_back(c, c);
+        }
+
+        return AddClass(std::move(r), negate);
+    }
+};
+
+/// Translates the syntax tree of a pattern into instructions.
+class RegexCompiler {
+    std::vector<Inst>& program;
+    U64                limit;
+
+    auto Push(Op op, U32 x = 0, U32 y = 0) -> U32 {
+        if (program.size() >= limit) throw RegexError{"Regular expression is too large"};
+        program.push_back({op, x, y});
+        return U32(program.size() - 1);
+    }
+
+    auto Here() const -> U32 { return U32(program.size()); }
+
+public:
+    RegexCompiler(std::vector<Inst>& _program) : program(_program), limit(_program.size() + max_rule_size) {}
+
+    void Compile(const RegexNode& node) {
+        switch (node.kind) {
+            case K::Empty: break;
+            case K::Char: Push(Op::Char, node.value); break;
+            case K::Any: Push(Op::Any); break;
+            case K::Class: Push(Op::Class, node.value); break;
+            case K::Assertion: Push(Op(node.value)); break;
+
+            case K::Concat:
+                for (const auto& child : node.children) Compile(child);
+                break;
+
+            case K::Alternate: {
+                std::vector<U32> jumps;
+                for (U64 i = 0; i < node.children.size() - 1; i++) {
+                    auto split = Push(Op::Split);
+                    program[split].x = Here();
+                    Compile(node.children[i]);
+                    jumps.push_back(Push(Op::Jmp));
+                    program[split].y = Here();
+                }
+                Compile(node.children.back());
+                for (auto j : jumps) program[j].x = Here();
+            } break;
+
+            case K::Group:
+                Push(Op::Save, 2 * node.value);
+                Compile(node.children.front());
+                Push(Op::Save, 2 * node.value + 1);
+                break;
+
+            case K::Repeat: {
+                const auto& body = node.children.front();
+                for (U32 i = 0; i < node.min; i++) Compile(body);
+
+                /// Optional copies all branch to the same exit.
+                std::vector<U32> splits;
+                if (node.max == unbounded) {
+                    auto loop = Push(Op::Split);
+                    Compile(body);
+                    Push(Op::Jmp, loop);
+                    splits.push_back(loop);
+                } else {
+                    for (U32 i = node.min; i < node.max; i++) {
+                        splits.push_back(Push(Op::Split));
+                        Compile(body);
+                    }
+                }
+
+                auto exit = Here();
+                for (auto s : splits) {
+                    program[s].x = node.greedy ? s + 1 : exit;
+                    program[s].y = node.greedy ? exit : s + 1;
+                }
+            } break;
+        }
+    }
+};
+
+auto ParseReplacement(const String& replacement, U32 groups) -> std::vector<RegexReplacer::ReplacementPart> {
+    std::vector<RegexReplacer::ReplacementPart> parts;
+    String                                      text;
+    for (U64 i = 0; i < replacement.size(); i++) {
+        if (replacement[i] == U'\\' && i + 1 < replacement.size() && U'0' <= replacement[i + 1] && replacement[i + 1] <= U'9') {
+            U32 group = replacement[++i] - U'0';
+            if (group > groups) throw RegexError{"Replacement refers to group " + std::to_string(group) + ", but the regular expression only has " + std::to_string(groups)};
+            if (!text.empty()) parts.push_back({std::move(text), std::nullopt});
+            parts.push_back({{}, group});
+            text.clear();
+        } else text += replacement[i];
+    }
+    if (!text.empty()) parts.push_back({std::move(text), std::nullopt});
+    return parts;
+}
+
+/// Set of threads, indexed by program counter, in priority order.
+struct ThreadList {
+    std::vector<U32> sparse;
+    std::vector<U32> dense;
+    std::vector<U64> caps;
+    U32              size = 0;
+    U32              slots;
+
+    ThreadList(U64 program_size, U32 _slots)
+        : sparse(program_size), dense(program_size), caps(program_size * _slots), slots(_slots) {}
+
+    void Insert(U32 pc) {
+        sparse[pc]    = size;
+        dense[size++] = pc;
+    }
+    auto Caps(U32 pc) -> U64* { return caps.data() + U64(pc) * slots; }
+};
+
+} // namespace
+
+/// Pike VM that finds the leftmost match of any rule.
+///
+/// Whether a thread at some instruction and position leads to a match
+/// doesn't depend on where the thread started, so a thread that reaches
+/// an instruction at a position that an earlier thread has already been
+/// at can be dropped: either the earlier thread matched, or this one
+/// won't match either. This holds across searches as well: if a search
+/// has to run past the match it finds, e.g. '(a*)c|a' on 'aaaa...', the
+/// next search doesn't run over the same text again. Threads that were
+/// cut off by a match never ran to completion, so positions at which a
+/// match was found aren't remembered. Each instruction is thus run at
+/// most once per position, plus once per match.
+///
+/// Only positions that a later search can start from have to be kept:
+/// the next search starts at the end of the match, so that's anything
+/// after the start of the oldest thread that is still running, or after
+/// the end of the match found so far. If a thread runs for a long time
+/// without matching, that can still be a lot of positions, so past a
+/// limit we only keep the ones the current step needs. A later search
+/// then runs over the positions that were forgotten again, which gives
+/// the same result, only more slowly.
+class RegexReplacer::Matcher {
+    const std::vector<Inst>&                program;
+    const std::vector<Ranges>&              classes;
+    const std::vector<RegexReplacer::Rule>& rules;
+    const std::optional<Ranges>&            first_chars;
+    const String&                           text;
+    ThreadList                              clist;
+    ThreadList                              nlist;
+    std::vector<U64>                        scratch;
+
+    /// One bit per instruction for every position starting at \c base
+    /// that a thread has been at.
+    std::deque<U64> visited;
+    U64             base = 0;
+    const U64       stride;
+
+    /// Maximum number of words in \c visited before we forget the
+    /// positions that a later search may need.
+    static constexpr U64 max_visited_words = U64(1) << 20;
+
+    /// Mark that a thread is at \p pc at \p pos. Returns false if one already was.
+    bool Visit(U32 pc, U64 pos) {
+        while (visited.size() <= (pos - base) * stride) visited.resize(visited.size() + stride);
+        auto& word = visited[(pos - base) * stride + pc / 64];
+        auto  bit  = U64(1) << (pc % 64);
+        if (word & bit) return false;
+        word |= bit;
+        return true;
+    }
+
+    /// Forget the threads at \p pos.
+    void Unvisit(const ThreadList& list, U64 pos) {
+        for (U32 i = 0; i < list.size; i++) visited[(pos - base) * stride + list.dense[i] / 64] &= ~(U64(1) << (list.dense[i] % 64));
+    }
+
+    /// Forget the positions before \p pos.
+    void Discard(U64 pos) {
+        if (pos <= base) return;
+        auto rows = std::min(pos - base, visited.size() / stride);
+        visited.erase(visited.begin(), visited.begin() + I64(rows * stride));
+        base = pos;
+    }
+
+    /// The position at which the oldest thread in \c clist started,
+    /// or \p pos if there is none.
+    auto Oldest(U64 pos) -> U64 {
+        for (U32 i = 0; i < clist.size; i++) {
+            const auto pc = clist.dense[i];
+            switch (program[pc].op) {
+                case Op::Char:
+                case Op::Any:
+                case Op::Class:
+                case Op::Match: pos = std::min(pos, clist.Caps(pc)[0]); break;
+
+                /// Only threads that consume a character or match have captures.
+                default: break;
+            }
+        }
+        return pos;
+    }
+
+    bool Holds(Op op, U64 pos) const {
+        switch (op) {
+            case Op::LineStart: return pos == 0 || text[pos - 1] == U'\n';
+            case Op::LineEnd: return pos == text.size() || text[pos] == U'\n';
+            case Op::WordBoundary:
+            case Op::NotWordBoundary: {
+                bool before = pos > 0 && IsWordChar(text[pos - 1]);
+                bool after  = pos < text.size() && IsWordChar(text[pos]);
+                return (before != after) == (op == Op::WordBoundary);
+            }
+            default: Unreachable("Not an assertion");
+        }
+    }
+
+    /// Follow all empty transitions from pc and add the resulting threads.
+    void AddThread(ThreadList& list, U32 pc, U64 pos) {
+        if (!Visit(pc, pos)) return;
+        list.Insert(pc);
+
+        const auto& inst = program[pc];
+        switch (inst.op) {
+            case Op::Jmp: return AddThread(list, inst.x, pos);
+            case Op::Split:
+                AddThread(list, inst.x, pos);
+                AddThread(list, inst.y, pos);
+                return;
+
+            case Op::Save: {
+                auto old        = scratch[inst.x];
+                scratch[inst.x] = pos;
+                AddThread(list, pc + 1, pos);
+                scratch[inst.x] = old;
+                return;
+            }
+
+            case Op::LineStart:
+            case Op::LineEnd:
+            case Op::WordBoundary:
+            case Op::NotWordBoundary:
+                if (Holds(inst.op, pos)) AddThread(list, pc + 1, pos);
+                return;
+
+            default: std::copy(scratch.begin(), scratch.end(), list.Caps(pc));
+        }
+    }
+
+public:
+    std::vector<U64> match;
+    U32              rule = 0;
+
+    Matcher(const RegexReplacer& re, const String& _text)
+        : program(re.program), classes(re.classes), rules(re.rules), first_chars(re.first_chars), text(_text),
+          clist(re.program.size(), re.slots), nlist(re.program.size(), re.slots), scratch(re.slots),
+          stride((re.program.size() + 63) / 64), match(re.slots) {}
+
+    /// Find the leftmost match at or after \p from. Searches
+    /// must be made in order of increasing \p from.
+    bool Find(U64 from) {
+        bool matched = false;
+        clist.size   = 0;
+
+        /// Start over if earlier positions were forgotten.
+        if (from < base) {
+            visited.clear();
+            base = from;
+        }
+
+        for (U64 pos = from;; pos++) {
+            /// Keep what this or a later search may need, within limits.
+            Discard(matched ? match[1] : Oldest(pos));
+            if (visited.size() > max_visited_words) Discard(pos);
+
+            if (!matched) {
+                /// Skip ahead to the next position at which a match can start.
+                if (clist.size == 0 && first_chars) {
+                    while (pos < text.size() && !Contains(*first_chars, text[pos])) pos++;
+                    if (pos == text.size()) return false;
+                }
+
+                std::fill(scratch.begin(), scratch.end(), no_match);
+                for (const auto& r : rules) AddThread(clist, r.start, pos);
+            }
+
+            if (clist.size == 0) {
+                if (matched || pos >= text.size()) break;
+                continue;
+            }
+
+            const Char c = pos < text.size() ? text[pos] : 0;
+            for (U32 i = 0; i < clist.size; i++) {
+                const auto  pc   = clist.dense[i];
+                const auto& inst = program[pc];
+                bool        step = false;
+                switch (inst.op) {
+                    case Op::Char: step = pos < text.size() && c == inst.x; break;
+                    case Op::Any: step = pos < text.size() && c != U'\n'; break;
+                    case Op::Class: step = pos < text.size() && Contains(classes[inst.x], c); break;
+                    case Op::Match: {
+                        matched = true;
+                        rule    = inst.x;
+                        auto caps = clist.Caps(pc);
+                        std::copy(caps, caps + match.size(), match.begin());
+
+                        /// Threads of lower priority can't produce a better match.
+                        Unvisit(clist, pos);
+                        i = clist.size;
+                    } break;
+                    /// Empty transitions have already been followed.
+                    default: break;
+                }
+
+                if (step) {
+                    auto caps = clist.Caps(pc);
+                    std::copy(caps, caps + scratch.size(), scratch.begin());
+                    AddThread(nlist, pc + 1, pos + 1);
+                }
+            }
+
+            std::swap(clist, nlist);
+            nlist.size = 0;
+            if (pos >= text.size()) break;
+        }
+
+        return matched;
+    }
+};
+auto RegexReplacer::Add(const String& pattern, const String& replacement) -> std::optional<std::string> {
+    auto program_size = program.size();
+    auto class_count  = classes.size();
+    try {
+        RegexParser parser{pattern, classes};
+        auto        tree = parser.Parse();
+        auto        repl = ParseReplacement(replacement, parser.groups);
+
+        /// Each rule's program is: Save 0; <pattern>; Save 1; Match <rule>.
+        Rule r{
+            .start       = U32(program.size()),
+            .first_class = U32(class_count),
+            .groups      = parser.groups,
+            .replacement = std::move(repl),
+        };
+        RegexCompiler compiler{program};
+        program.push_back({Op::Save, 0});
+        compiler.Compile(tree);
+        program.push_back({Op::Save, 1});
+        program.push_back({Op::Match, U32(rules.size())});
+
+        slots = std::max(slots, 2 * (parser.groups + 1));
+        rules.push_back(std::move(r));
+        ComputeFirstChars();
+        return std::nullopt;
+    } catch (const RegexError& e) {
+        program.resize(program_size);
+        classes.resize(class_count);
+        return e.message;
+    }
+}
+
+void RegexReplacer::Truncate(U64 count) {
+    if (count >= rules.size()) return;
+    program.resize(rules[count].start);
+    classes.resize(rules[count].first_class);
+    rules.resize(count);
+    slots = 2;
+    for (const auto& r : rules) slots = std::max(slots, 2 * (r.groups + 1));
+    ComputeFirstChars();
+}
+
+void RegexReplacer::ComputeFirstChars() {
+    Ranges            r;
+    std::vector<U32>  stack;
+    std::vector<bool> seen(program.size());
+    for (const auto& rule : rules) stack.push_back(rule.start);
+    while (!stack.empty()) {
+        auto pc = stack.back();
+        stack.pop_back();
+        if (seen[pc]) continue;
+        seen[pc] = true;
+
+        const auto& inst = program[pc];
+        switch (inst.op) {
+            case Op::Char: r.emplace_back(Char(inst.x), Char(inst.x)); break;
+            case Op::Class: r.insert(r.end(), classes[inst.x].begin(), classes[inst.x].end()); break;
+            case Op::Save: stack.push_back(pc + 1); break;
+            case Op::Jmp: stack.push_back(inst.x); break;
+            case Op::Split:
+                stack.push_back(inst.y);
+                stack.push_back(inst.x);
+                break;
+
+            /// A rule that can match the empty string or that starts
+            /// with an assertion or '.' can start almost anywhere.
+            default:
+                first_chars.reset();
+                return;
+        }
+    }
+
+    Normalise(r);
+    first_chars = std::move(r);
+}
+
+void RegexReplacer::Apply(String& text) const {
+    if (rules.empty()) return;
+
+    Matcher m{*this, text};
+    String  out;
+    U64     pos = 0;
+    while (pos <= text.size() && m.Find(pos)) {
+        const auto start = m.match[0];
+        const auto end   = m.match[1];
+        out.append(text, pos, start - pos);
+        for (const auto& part : rules[m.rule].replacement) {
+            if (!part.group) out += part.text;
+            else if (auto s = m.match[2 * *part.group], e = m.match[2 * *part.group + 1]; s != no_match && e != no_match)
+                out.append(text, s, e - s);
+        }
+
+        /// After an empty match, copy the next character so we make progress.
+        if (end == start) {
+            if (start < text.size()) out += text[start];
+            pos = start + 1;
+        } else pos = end;
+    }
+
+    if (pos == 0) return;
+    if (pos < text.size()) out.append(text, pos);
+    text = std::move(out);
+}
+} // namespace TeX
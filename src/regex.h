@@ -0,0 +1,94 @@
+#ifndef XPP_REGEX_H
+#define XPP_REGEX_H
+
+#include <optional>
+#include <string>
+#include <utility>
+#include <utils/parser.h>
+#include <vector>
+
+namespace TeX {
+/// Regular-expression replacement rules (\ReplaceRegex).
+///
+/// Patterns are compiled into a Thompson NFA when a rule is added; all
+/// rules share one program that is simulated by a Pike VM, which never
+/// backtracks, so applying them takes time linear in the length of the
+/// text and the size of the program. At each position, the rule that
+/// was defined first wins; quantifiers are greedy unless followed by '?'.
+///
+/// Supported syntax: literals, '.', classes ('[a-z]', '[^...]'), the
+/// escapes \d \w \s \D \W \S \n \t \r, anchors '^', '$' (which match at
+/// line boundaries), \b and \B, groups '(...)' and '(?:...)', '|',
+/// and the quantifiers *, +, ?, {n}, {n,} and {n,m}. Backreferences are
+/// not supported since they can't be matched without backtracking.
+///
+/// In the replacement, \0 to \9 insert the text matched by a group;
+/// everything else is inserted as-is.
+class RegexReplacer {
+public:
+    using Ranges = std::vector<std::pair<Char, Char>>;
+
+    enum struct Op : U8 {
+        Char,
+        Any,
+        Class,
+        Split,
+        Jmp,
+        Save,
+        Match,
+        LineStart,
+        LineEnd,
+        WordBoundary,
+        NotWordBoundary,
+    };
+
+    /// A single instruction. The meaning of the operands depends on the opcode.
+    struct Inst {
+        Op  op;
+        U32 x = 0;
+        U32 y = 0;
+    };
+
+    /// Part of a replacement; either literal text or a group.
+    struct ReplacementPart {
+        String             text;
+        std::optional<U32> group;
+    };
+
+    struct Rule {
+        U32                          start;
+        U32                          first_class;
+        U32                          groups;
+        std::vector<ReplacementPart> replacement;
+    };
+
+private:
+    class Matcher;
+
+    std::vector<Inst>   program;
+    std::vector<Ranges> classes;
+    std::vector<Rule>   rules;
+    U32                 slots = 2;
+
+    /// Characters that can start a match, if they can be determined.
+    std::optional<Ranges> first_chars;
+
+    void ComputeFirstChars();
+
+public:
+    /// Compile and add a rule. Returns an error message if the
+    /// pattern or the replacement is invalid.
+    auto Add(const String& pattern, const String& replacement) -> std::optional<std::string>;
+
+    /// Apply all rules to a string in one pass.
+    void Apply(String& text) const;
+
+    /// Remove all rules but the first \p count.
+    void Truncate(U64 count);
+
+    bool empty() const { return rules.empty(); }
+    auto size() const -> U64 { return rules.size(); }
+};
+} // namespace TeX
+
+#endif // XPP_REGEX_H
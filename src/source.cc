@@ -0,0 +1,102 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TeX {
+/// Decode UTF-8 the same way ChunkedReader::Next() does.
+void DecodeUTF8(std::string_view bytes, String& out) {
+    static constexpr Char replacement_char = 0xFFFD;
+    out.reserve(out.size() + bytes.size());
+    for (U64 pos = 0; pos < bytes.size();) {
+        const auto lead = U8(bytes[pos++]);
+        if (lead < 0x80) {
+            out += Char(lead);
+            continue;
+        }
+
+        U64  len = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+        Char c   = lead & (0x3F >> len);
+        if (len == 0 || lead >= 0xF8) {
+            out += replacement_char;
+            continue;
+        }
+
+        U64 i = 0;
+        for (; i < len && pos < bytes.size() && (U8(bytes[pos]) & 0xC0) == 0x80; i++, pos++)
+            c = (c << 6) | (U8(bytes[pos]) & 0x3F);
+        out += i == len ? c : replacement_char;
+    }
+}
+
+auto ReadInput(const std::string& path) -> std::optional<std::string> {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return std::nullopt;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return std::nullopt;
+    }
+
+    std::string contents(U64(st.st_size), '\0');
+    U64         size = 0;
+    while (size < contents.size()) {
+        auto n = read(fd, contents.data() + size, contents.size() - size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        size += U64(n);
+    }
+    close(fd);
+    contents.resize(size);
+    if (auto c = DetectCompression(contents); c != Compression::None) return Decompress(contents, c);
+    return contents;
+}
+
+/// Line starts are recorded here rather than when the file is read
+/// since the lexer doesn't see every character, e.g. if they were
+/// lexed ahead of time.
+auto SourceMap::Add(const std::string& path, const String& text) -> U32 {
+    if (auto it = ids.find(path); it != ids.end()) return it->second;
+
+    std::vector<U32> line_starts{0};
+    for (U64 i = 0; i < text.size(); i++)
+        if (text[i] == U'\n') line_starts.push_back(U32(i + 1));
+
+    files.push_back({path, U32(text.size()), std::move(line_starts)});
+    ids[path] = U32(files.size() - 1);
+    return U32(files.size() - 1);
+}
+
+auto SourceMap::AddUnread(const std::string& path, std::vector<U32> line_starts) -> U32 {
+    if (auto it = ids.find(path); it != ids.end()) return it->second;
+    files.push_back({path, std::numeric_limits<U32>::max(), std::move(line_starts)});
+    ids[path] = U32(files.size() - 1);
+    return U32(files.size() - 1);
+}
+
+auto SourceMap::AddStream(const std::string& name) -> U32 {
+    files.push_back({name, std::numeric_limits<U32>::max(), {0}});
+    return U32(files.size() - 1);
+}
+
+void SourceMap::Truncate(U64 count) {
+    if (count >= files.size()) return;
+    for (U64 i = count; i < files.size(); i++) ids.erase(files[i].path);
+    files.resize(count);
+}
+
+auto SourceMap::Print(Location loc) const -> std::string {
+    auto [line, col] = LineAndColumn(loc);
+    return files[loc.file].path + ":" + std::to_string(line) + ":" + std::to_string(col);
+}
+
+auto SourceMap::LineAndColumn(Location loc) const -> std::pair<U64, U64> {
+    const auto& f    = files[loc.file];
+    auto        line = std::upper_bound(f.line_starts.begin(), f.line_starts.end(), loc.offset) - 1;
+    return {U64(line - f.line_starts.begin()) + 1, U64(loc.offset - *line) + 1};
+}
+} // namespace TeX
@@ -0,0 +1,58 @@
+#ifndef XPP_SPSC_QUEUE_H
+#define XPP_SPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+namespace TeX {
+/// Bounded lock-free queue for exactly one producer and one consumer thread.
+///
+/// Push() and Pop() never take a lock; they only block (via atomic wait)
+/// if the queue is full or empty, respectively.
+template <typename T, std::uint64_t capacity>
+class SPSCQueue {
+    static_assert(capacity && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+
+    std::array<T, capacity> slots{};
+
+    /// Index of the next element to pop. Only written by the consumer.
+    alignas(64) std::atomic<std::uint64_t> head{};
+
+    /// Index of the next element to push. Only written by the producer.
+    alignas(64) std::atomic<std::uint64_t> tail{};
+
+public:
+    /// Append an element; blocks while the queue is full.
+    void Push(T value) {
+        const auto t = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            const auto h = head.load(std::memory_order_acquire);
+            if (t - h < capacity) break;
+            head.wait(h, std::memory_order_acquire);
+        }
+
+        slots[t & (capacity - 1)] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+
+    /// Remove the oldest element; blocks while the queue is empty.
+    auto Pop() -> T {
+        const auto h = head.load(std::memory_order_relaxed);
+        for (;;) {
+            const auto t = tail.load(std::memory_order_acquire);
+            if (t != h) break;
+            tail.wait(t, std::memory_order_acquire);
+        }
+
+        T value = std::move(slots[h & (capacity - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return value;
+    }
+};
+} // namespace TeX
+
+#endif // XPP_SPSC_QUEUE_H
@@ -0,0 +1,114 @@
+#include "parser.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TeX {
+/// Size of the chunks read from a stream.
+constexpr U64 stream_chunk_size = 64 * 1024;
+
+bool ChunkedReader::IsStream(const std::string& path) {
+    if (path == "-") return true;
+    struct stat st {};
+    return stat(path.c_str(), &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode));
+}
+
+bool ChunkedReader::IsCompressed(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char magic[4];
+    auto n = read(fd, magic, sizeof magic);
+    close(fd);
+    return n > 0 && DetectCompression({magic, U64(n)}) != Compression::None;
+}
+
+ChunkedReader::ChunkedReader(const std::string& path) : buffer(new char[stream_chunk_size]), data(buffer.get()) {
+    if (path == "-") fd = STDIN_FILENO;
+    else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw ProcessingError("Could not open " + path + ": " + strerror(errno));
+        owned = true;
+    }
+}
+
+ChunkedReader::~ChunkedReader() {
+    if (owned) close(fd);
+}
+
+/// Read up to \p capacity bytes; returns 0 at the end of the input.
+auto ChunkedReader::Read(char* into, U64 capacity) -> U64 {
+    for (;;) {
+        auto n = read(fd, into, capacity);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw ProcessingError(std::string{"Could not read input: "} + strerror(errno));
+        return U64(n);
+    }
+}
+
+bool ChunkedReader::Refill() {
+    if (eof) return false;
+    pos = 0;
+
+    /// Check if the input is compressed. A pipe might return fewer
+    /// bytes than we need for that, so keep reading until we have them.
+    if (!started) {
+        started = true;
+        size    = 0;
+        for (U64 n; size < 4 && (n = Read(buffer.get() + size, stream_chunk_size - size)); size += n);
+        if (auto c = DetectCompression({buffer.get(), size}); c != Compression::None) {
+            decompressor = Decompressor::Create(c);
+            decompressor->Decompress({buffer.get(), size}, decompressed);
+            if (!decompressed.empty()) {
+                data = decompressed.data();
+                size = decompressed.size();
+                return true;
+            }
+        } else {
+            eof = size == 0;
+            return !eof;
+        }
+    }
+
+    if (!decompressor) {
+        size = Read(buffer.get(), stream_chunk_size);
+        eof  = size == 0;
+        return !eof;
+    }
+
+    /// A chunk of compressed data may not produce any output yet.
+    decompressed.clear();
+    while (decompressed.empty()) {
+        auto n = Read(buffer.get(), stream_chunk_size);
+        if (n == 0) {
+            decompressor->Finish(decompressed);
+            eof = true;
+            if (decompressed.empty()) return false;
+            break;
+        }
+        decompressor->Decompress({buffer.get(), n}, decompressed);
+    }
+    data = decompressed.data();
+    size = decompressed.size();
+    return true;
+}
+
+auto ChunkedReader::Next() -> std::optional<Char> {
+    if (pos == size && !Refill()) return std::nullopt;
+    const auto lead = U8(data[pos++]);
+    if (lead < 0x80) return Char(lead);
+
+    /// Decode a multibyte sequence. Its continuation bytes may be in the next chunk.
+    U64  len = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    Char c   = lead & (0x3F >> len);
+    if (len == 0 || lead >= 0xF8) return replacement_char;
+    for (U64 i = 0; i < len; i++) {
+        if (pos == size && !Refill()) return replacement_char;
+        const auto cont = U8(data[pos]);
+        if ((cont & 0xC0) != 0x80) return replacement_char;
+        c = (c << 6) | (cont & 0x3F);
+        pos++;
+    }
+    return c;
+}
+} // namespace TeX
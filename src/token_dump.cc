@@ -0,0 +1,208 @@
+#include "parser.h"
+#include "token_dump.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TeX {
+namespace {
+auto Align(std::uint64_t n) -> std::uint64_t { return (n + 7) & ~std::uint64_t(7); }
+
+/// Builds a token dump in memory.
+class TokenDumpWriter {
+    std::vector<TokenRecord>           tokens;
+    std::vector<StringRecord>          strings;
+    std::unordered_map<String, U32>    ids;
+    std::string                        string_data;
+
+public:
+    auto Intern(const String& str) -> U32 {
+        auto [it, inserted] = ids.try_emplace(str, U32(strings.size()));
+        if (inserted) {
+            auto utf8 = ToUTF8(str);
+            strings.push_back({string_data.size(), utf8.size()});
+            string_data += utf8;
+        }
+        return it->second;
+    }
+
+    void Add(const Node& node) {
+        tokens.push_back({
+            .type   = U32(node.type),
+            .string = Intern(node.string_content),
+            .file   = node.loc.file,
+            .offset = node.loc.offset,
+            .number = node.number,
+        });
+    }
+
+    auto Finish(const SourceMap& sources) -> std::string {
+        std::vector<FileRecord> files;
+        std::vector<U32>        line_starts;
+        for (U32 i = 0; i < sources.Count(); i++) {
+            const auto& lines = sources.LineStarts(i);
+            files.push_back({Intern(ToUTF32(sources.Path(i))), U32(lines.size()), line_starts.size()});
+            line_starts.insert(line_starts.end(), lines.begin(), lines.end());
+        }
+
+        TokenDumpHeader header{};
+        std::memcpy(header.magic, token_dump_magic, sizeof header.magic);
+        header.version            = token_dump_version;
+        header.header_size        = sizeof header;
+        header.token_count        = tokens.size();
+        header.tokens_offset      = Align(sizeof header);
+        header.string_count       = strings.size();
+        header.strings_offset     = Align(header.tokens_offset + tokens.size() * sizeof(TokenRecord));
+        header.file_count         = files.size();
+        header.files_offset       = Align(header.strings_offset + strings.size() * sizeof(StringRecord));
+        header.line_start_count   = line_starts.size();
+        header.line_starts_offset = Align(header.files_offset + files.size() * sizeof(FileRecord));
+        header.string_data_offset = Align(header.line_starts_offset + line_starts.size() * sizeof(U32));
+        header.string_data_size   = string_data.size();
+
+        std::string out(header.string_data_offset + string_data.size(), '\0');
+        auto        Write = [&](U64 offset, const void* src, U64 bytes) {
+            if (bytes) std::memcpy(out.data() + offset, src, bytes);
+        };
+        Write(0, &header, sizeof header);
+        Write(header.tokens_offset, tokens.data(), tokens.size() * sizeof(TokenRecord));
+        Write(header.strings_offset, strings.data(), strings.size() * sizeof(StringRecord));
+        Write(header.files_offset, files.data(), files.size() * sizeof(FileRecord));
+        Write(header.line_starts_offset, line_starts.data(), line_starts.size() * sizeof(U32));
+        Write(header.string_data_offset, string_data.data(), string_data.size());
+        return out;
+    }
+};
+} // namespace
+
+bool TokenDump::IsTokenDump(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char magic[sizeof token_dump_magic]{};
+    auto n = read(fd, magic, sizeof magic);
+    close(fd);
+    return n == sizeof magic && std::memcmp(magic, token_dump_magic, sizeof magic) == 0;
+}
+
+TokenDump::TokenDump(const std::string& path) {
+    auto Invalid = [&](const std::string& why) -> ProcessingError {
+        return ProcessingError(path + ": Invalid token dump: " + why);
+    };
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw ProcessingError("Could not open " + path + ": " + strerror(errno));
+    struct stat st {};
+    if (fstat(fd, &st) < 0 || U64(st.st_size) < sizeof(TokenDumpHeader)) {
+        close(fd);
+        throw Invalid("File too small");
+    }
+
+    size    = U64(st.st_size);
+    auto* m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) throw ProcessingError("Could not map " + path + ": " + strerror(errno));
+    data   = static_cast<const char*>(m);
+    header = reinterpret_cast<const TokenDumpHeader*>(data);
+
+    /// Make sure that everything we'll access is in bounds.
+    auto InBounds = [&](U64 offset, U64 count, U64 elem_size) {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / elem_size;
+    };
+
+    try {
+        if (std::memcmp(header->magic, token_dump_magic, sizeof token_dump_magic) != 0) throw Invalid("Bad magic number");
+        if (header->version != token_dump_version) throw Invalid("Unsupported version " + std::to_string(header->version));
+        if (!InBounds(header->tokens_offset, header->token_count, sizeof(TokenRecord))
+            || !InBounds(header->strings_offset, header->string_count, sizeof(StringRecord))
+            || !InBounds(header->files_offset, header->file_count, sizeof(FileRecord))
+            || !InBounds(header->line_starts_offset, header->line_start_count, sizeof(U32))
+            || !InBounds(header->string_data_offset, header->string_data_size, 1))
+            throw Invalid("Section out of bounds");
+
+        for (const auto& s : std::span{reinterpret_cast<const StringRecord*>(data + header->strings_offset), header->string_count})
+            if (s.offset > header->string_data_size || s.size > header->string_data_size - s.offset) throw Invalid("String out of bounds");
+        for (const auto& f : Files()) {
+            if (f.path >= header->string_count) throw Invalid("Invalid file name");
+            if (f.line_count == 0 || f.first_line > header->line_start_count || f.line_count > header->line_start_count - f.first_line)
+                throw Invalid("Line starts out of bounds");
+            auto lines = LineStarts(f);
+            if (lines[0] != 0 || !std::is_sorted(lines.begin(), lines.end())) throw Invalid("Invalid line starts");
+        }
+        for (const auto& t : Tokens())
+            if (t.string >= header->string_count || t.file >= header->file_count) throw Invalid("Invalid token");
+    } catch (...) {
+        munmap(const_cast<char*>(data), size);
+        throw;
+    }
+}
+
+TokenDump::~TokenDump() {
+    munmap(const_cast<char*>(data), size);
+}
+
+auto TokenDump::Tokens() const -> std::span<const TokenRecord> {
+    return {reinterpret_cast<const TokenRecord*>(data + header->tokens_offset), header->token_count};
+}
+
+auto TokenDump::String(std::uint32_t id) const -> std::string_view {
+    const auto& s = reinterpret_cast<const StringRecord*>(data + header->strings_offset)[id];
+    return {data + header->string_data_offset + s.offset, s.size};
+}
+
+auto TokenDump::Files() const -> std::span<const FileRecord> {
+    return {reinterpret_cast<const FileRecord*>(data + header->files_offset), header->file_count};
+}
+
+auto TokenDump::LineStarts(const FileRecord& file) const -> std::span<const std::uint32_t> {
+    return {reinterpret_cast<const U32*>(data + header->line_starts_offset) + file.first_line, file.line_count};
+}
+
+auto Parser::DumpTokens() -> std::string {
+    TokenDumpWriter writer;
+    Start();
+    while (token.type != T::EndOfFile) {
+        writer.Add(token);
+        NextToken();
+    }
+    ThrowIfError();
+    return writer.Finish(sources);
+}
+
+void Parser::ReplayFrom(const std::string& path) {
+    replay = std::make_unique<Replay>(path);
+
+    /// Register the files that the tokens came from.
+    for (const auto& f : replay->dump.Files()) {
+        auto lines = replay->dump.LineStarts(f);
+        replay->files.push_back(sources.AddUnread(std::string{replay->dump.String(f.path)}, {lines.begin(), lines.end()}));
+    }
+    replay->strings.resize(replay->dump.StringCount());
+}
+
+void Parser::ReplayToken() {
+    auto tokens = replay->dump.Tokens();
+    if (replay->index == tokens.size()) {
+        token.type = TokenType::EndOfFile;
+        at_eof     = true;
+        return;
+    }
+
+    /// Convert each string only once.
+    const auto& t = tokens[replay->index++];
+    auto&       s = replay->strings[t.string];
+    if (!s) s = ToUTF32(std::string{replay->dump.String(t.string)});
+
+    token.type           = TokenType(t.type);
+    token.string_content = *s;
+    token.number         = t.number;
+    token.loc            = {replay->files[t.file], t.offset};
+
+    /// The lexer sets at_eof once it has read the last character, i.e.
+    /// when it returns the last token; do the same here.
+    at_eof = replay->index == tokens.size();
+}
+} // namespace TeX
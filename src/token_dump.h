@@ -0,0 +1,99 @@
+#ifndef XPP_TOKEN_DUMP_H
+#define XPP_TOKEN_DUMP_H
+
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+/// Binary token dump, written by '--print-tokens --binary'.
+///
+/// The file is meant to be memory-mapped and read in place. All integers
+/// are little-endian, and every section starts at a multiple of 8 bytes:
+///
+///   TokenDumpHeader
+///   TokenRecord  tokens[token_count]
+///   StringRecord strings[string_count]
+///   FileRecord   files[file_count]
+///   uint32_t     line_starts[line_start_count]
+///   char         string_data[string_data_size]
+///
+/// Strings are UTF-8 and are not NUL-terminated; identical strings are
+/// stored once. Token locations are an offset in characters (code
+/// points, not bytes) into one of the source files. The offsets at which
+/// the lines of each file start are stored as well, so locations can be
+/// printed without reading the source files again.
+namespace TeX {
+static_assert(std::endian::native == std::endian::little, "Token dumps are little-endian");
+
+constexpr char          token_dump_magic[8] = {'X', 'P', 'P', 'T', 'O', 'K', 'S', '\0'};
+constexpr std::uint32_t token_dump_version  = 2;
+
+struct TokenDumpHeader {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint64_t token_count;
+    std::uint64_t tokens_offset;
+    std::uint64_t string_count;
+    std::uint64_t strings_offset;
+    std::uint64_t file_count;
+    std::uint64_t files_offset;
+    std::uint64_t line_start_count;
+    std::uint64_t line_starts_offset;
+    std::uint64_t string_data_offset;
+    std::uint64_t string_data_size;
+};
+
+struct TokenRecord {
+    /// A TokenType.
+    std::uint32_t type;
+    std::uint32_t string;
+    std::uint32_t file;
+    std::uint32_t offset;
+
+    /// The number of a macro argument.
+    std::uint64_t number;
+};
+
+struct StringRecord {
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+struct FileRecord {
+    /// String ID of the path of the file.
+    std::uint32_t path;
+
+    /// The file's line starts are line_starts[first_line, first_line + line_count).
+    std::uint32_t line_count;
+    std::uint64_t first_line;
+};
+
+/// A memory-mapped token dump. The constructor validates the file.
+class TokenDump {
+    const char*            data = nullptr;
+    std::uint64_t          size = 0;
+    const TokenDumpHeader* header{};
+
+public:
+    /// Throws ProcessingError if the file can't be read or is invalid.
+    explicit TokenDump(const std::string& path);
+    ~TokenDump();
+
+    TokenDump(const TokenDump&)            = delete;
+    TokenDump& operator=(const TokenDump&) = delete;
+
+    auto Tokens() const -> std::span<const TokenRecord>;
+    auto String(std::uint32_t id) const -> std::string_view;
+    auto StringCount() const -> std::uint64_t { return header->string_count; }
+    auto Files() const -> std::span<const FileRecord>;
+    auto LineStarts(const FileRecord& file) const -> std::span<const std::uint32_t>;
+
+    /// Check whether a file starts with the magic number.
+    static bool IsTokenDump(const std::string& path);
+};
+} // namespace TeX
+
+#endif // XPP_TOKEN_DUMP_H
@@ -0,0 +1,69 @@
+#include "cli.h"
+
+#include <iostream>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace TeX::cli {
+namespace fs = std::filesystem;
+
+void Watch(const std::string& file, const Options& opts) {
+    if (options::get<"--format">() || options::get<"--wc">() || options::get<"--print-tokens">())
+        Die("--watch can only be used when preprocessing");
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) Die("Could not initialise inotify: %s", strerror(errno));
+
+    WatchSession            session;
+    std::map<int, fs::path> dirs;
+    std::set<fs::path>      watched;
+    alignas(inotify_event) char buffer[4096];
+    for (;;) {
+        try {
+            Parser p{file, opts};
+            p.watch = &session;
+            auto text = p.Preprocess();
+            WriteOutput(text, p.dependencies);
+        } catch (const ProcessingError& e) {
+            std::cerr << e.what() << "\n";
+        }
+
+        /// Watch the directories that contain the files rather than the files
+        /// themselves so we notice if an editor replaces a file instead of
+        /// writing to it.
+        std::set<fs::path> deps;
+        for (const auto& dep : session.dependencies) {
+            auto path = NormalisePath(dep);
+            auto dir  = path.parent_path();
+            deps.insert(std::move(path));
+            if (watched.contains(dir)) continue;
+
+            int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0) Die("Could not watch directory %s: %s", dir.c_str(), strerror(errno));
+            dirs[wd] = dir;
+            watched.insert(std::move(dir));
+        }
+
+        /// Wait until one of the files changes.
+        std::set<fs::path> changed;
+        while (changed.empty()) {
+            auto n = read(fd, buffer, sizeof buffer);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                Die("Could not read inotify events: %s", strerror(errno));
+            }
+
+            for (char* p = buffer; p < buffer + n;) {
+                auto event = reinterpret_cast<inotify_event*>(p);
+                if (event->len) {
+                    auto path = dirs[event->wd] / event->name;
+                    if (deps.contains(path)) changed.insert(std::move(path));
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        session.ResumePoint(changed);
+    }
+}
+} // namespace TeX::cli
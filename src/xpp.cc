@@ -0,0 +1,97 @@
+#include "parser.h"
+
+#include <mutex>
+
+namespace TeX {
+struct Context::Impl {
+    Options                  opts;
+    std::mutex               mtx;
+    NodeList                 tokens;
+    String                   text;
+    std::vector<std::string> dependencies;
+
+    /// Formatting rules, compiled on first use.
+    std::optional<FormatRules> format_rules;
+
+    auto Rules() -> const FormatRules& {
+        if (!format_rules) format_rules.emplace(opts);
+        return *format_rules;
+    }
+
+    /// Run a parser on an input, reusing our buffers. Compressed input
+    /// is decompressed first, as it is when reading a file; the callback
+    /// gets the parser and the decompressed input.
+    template <typename Callable>
+    auto Run(std::string_view input, Callable callback) {
+        std::unique_lock           lock{mtx};
+        std::optional<std::string> decompressed;
+        if (auto c = DetectCompression(input); c != Compression::None) input = decompressed.emplace(Decompress(input, c));
+
+        Parser p{"<input>", opts, input};
+        tokens.clear();
+        text.clear();
+        std::swap(p.tokens, tokens);
+        std::swap(p.processed_text, text);
+
+        /// Hand the buffers back even if processing fails.
+        struct Reclaim {
+            Impl&   impl;
+            Parser& p;
+            ~Reclaim() {
+                std::swap(p.tokens, impl.tokens);
+                std::swap(p.processed_text, impl.text);
+            }
+        } reclaim{*this, p};
+
+        auto result = callback(p, input);
+        dependencies.assign(p.dependencies.begin() + 1, p.dependencies.end());
+        return result;
+    }
+};
+
+Context::Context(Options opts) : impl(std::make_unique<Impl>()) { impl->opts = std::move(opts); }
+Context::~Context() = default;
+
+auto Context::Preprocess(std::string_view input) -> std::string {
+    return impl->Run(input, [](Parser& p, std::string_view) { return p.Preprocess(); });
+}
+
+auto Context::Format(std::string_view input) -> std::string {
+    return impl->Run(input, [this](Parser& p, std::string_view) {
+        p.format_rules = &impl->Rules();
+        return p.Format();
+    });
+}
+
+auto Context::CheckFormat(std::string_view input) -> bool {
+    return impl->Run(input, [this](Parser& p, std::string_view text) {
+        p.format_rules = &impl->Rules();
+        return p.CheckFormat(text);
+    });
+}
+
+auto Context::CountWords(std::string_view input) -> WordCount {
+    return impl->Run(input, [](Parser& p, std::string_view) { return p.CountWords(); });
+}
+
+auto Context::Dependencies() const -> std::vector<std::string> {
+    std::unique_lock lock{impl->mtx};
+    return impl->dependencies;
+}
+
+auto Preprocess(std::string_view input, const Options& opts) -> std::string {
+    return Context{opts}.Preprocess(input);
+}
+
+auto Format(std::string_view input, const Options& opts) -> std::string {
+    return Context{opts}.Format(input);
+}
+
+auto CheckFormat(std::string_view input, const Options& opts) -> bool {
+    return Context{opts}.CheckFormat(input);
+}
+
+auto CountWords(std::string_view input) -> WordCount {
+    return Context{}.CountWords(input);
+}
+} // namespace TeX
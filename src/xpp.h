@@ -0,0 +1,93 @@
+#ifndef XPP_XPP_H
+#define XPP_XPP_H
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Public interface of libxpp.
+///
+/// Each call processes one input buffer and returns the result as a
+/// buffer. \Include directives in the input are resolved relative to
+/// the current working directory.
+namespace TeX {
+/// Options that affect the output.
+struct Options {
+    /// The maximum line width when formatting.
+    std::uint64_t line_width = 100;
+
+    /// Environments that should be indented like enumerate when
+    /// formatting, in addition to enumerate and itemize.
+    std::vector<std::string> enumerate_envs;
+
+    /// Additional formatting rules, one per line; see format_rules.h.
+    std::string format_rules;
+
+    /// Run parsing, text merging and emission as concurrent stages.
+    bool pipeline = false;
+
+    /// Read included files ahead of time on background threads.
+    bool prefetch_includes = false;
+
+    /// Lex large inputs on several threads.
+    bool parallel_lexing = false;
+
+    /// Construct and encode the output of large documents on several threads.
+    bool parallel_emit = false;
+};
+
+/// Thrown if the input contains errors. The message contains
+/// all diagnostics that were issued, one per line.
+struct ProcessingError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct WordCount {
+    std::uint64_t chars{};
+    std::uint64_t words{};
+};
+
+/// A reusable context for processing inputs.
+///
+/// A context keeps its buffers between calls, so processing many
+/// inputs with the same context avoids most allocations. Calls on
+/// the same context are serialised; use one context per thread
+/// to process several inputs in parallel.
+class Context {
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+
+public:
+    explicit Context(Options opts = {});
+    ~Context();
+
+    Context(const Context&)            = delete;
+    Context& operator=(const Context&) = delete;
+
+    /// Preprocess an input.
+    auto Preprocess(std::string_view input) -> std::string;
+
+    /// Format an input.
+    auto Format(std::string_view input) -> std::string;
+
+    /// Check whether formatting an input wouldn't change it.
+    auto CheckFormat(std::string_view input) -> bool;
+
+    /// Count the number of characters and words in an input.
+    auto CountWords(std::string_view input) -> WordCount;
+
+    /// Files included by the last call to Preprocess().
+    auto Dependencies() const -> std::vector<std::string>;
+};
+
+/// Convenience functions that use a temporary context.
+auto Preprocess(std::string_view input, const Options& opts = {}) -> std::string;
+auto Format(std::string_view input, const Options& opts = {}) -> std::string;
+auto CheckFormat(std::string_view input, const Options& opts = {}) -> bool;
+auto CountWords(std::string_view input) -> WordCount;
+} // namespace TeX
+
+#endif // XPP_XPP_H
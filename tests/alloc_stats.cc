@@ -0,0 +1,180 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/// Allocation budget test.
+///
+/// Preprocesses, formats and counts the words of each file given on the
+/// command line, counts the allocations made in each phase (see phase.h),
+/// and fails if the allocations or bytes allocated per KiB of input exceed
+/// those in the budget file. This replaces the global allocation functions,
+/// which is why it is a program of its own rather than part of xpp.
+///
+/// Usage: xpp-alloc-test <budget> <file>...
+namespace TeX::test {
+namespace {
+constexpr auto phase_count = U64(Phase::Count);
+
+constexpr std::array<std::string_view, phase_count> phase_names{
+    "Other",
+    "Parse",
+    "MergeTextNodes",
+    "HandleMacroExpansion",
+    "Emit",
+    "FormatPass1",
+    "FormatPass2",
+};
+
+std::atomic<bool>                        counting;
+std::array<std::atomic<U64>, phase_count> allocations;
+std::array<std::atomic<U64>, phase_count> allocated_bytes;
+
+/// What is done to each input.
+struct Mode {
+    std::string_view name;
+    void (*run)(const std::string& path, const Options& opts);
+};
+
+constexpr std::array modes{
+    Mode{"preprocess", [](const std::string& path, const Options& opts) { Parser{path, opts}.Preprocess(); }},
+    Mode{"format", [](const std::string& path, const Options& opts) { Parser{path, opts}.Format(); }},
+    Mode{"wc", [](const std::string& path, const Options& opts) { Parser{path, opts}.CountWords(); }},
+};
+
+struct Budget {
+    double allocations;
+    double bytes;
+};
+
+[[noreturn]] void Fail(const char* fmt, ...) {
+    std::va_list ap;
+    va_start(ap, fmt);
+    std::vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    std::fputc('\n', stderr);
+    std::exit(1);
+}
+
+/// Parse a budget file. Each line is '<mode> <phase> <allocations/KiB> <bytes/KiB>',
+/// where mode is one of the modes above and phase one of the phases above
+/// or 'Total'. Lines starting with '%' are comments.
+auto ReadBudget(const std::string& path) -> std::map<std::pair<std::string, std::string>, Budget> {
+    std::ifstream lines{path};
+    if (!lines) Fail("Could not read allocation budget from %s", path.c_str());
+
+    std::map<std::pair<std::string, std::string>, Budget> budget;
+    std::string                                          line;
+    for (U64 n = 1; std::getline(lines, line); n++) {
+        std::istringstream fields{line};
+        std::string        mode, phase;
+        Budget             b{};
+        if (!(fields >> mode) || mode.starts_with('%')) continue;
+        if (!(fields >> phase >> b.allocations >> b.bytes))
+            Fail("%s:%zu: Error: Expected '<mode> <phase> <allocations/KiB> <bytes/KiB>'", path.c_str(), n);
+        if (std::none_of(modes.begin(), modes.end(), [&](const Mode& m) { return m.name == mode; }))
+            Fail("%s:%zu: Error: Unknown mode '%s'", path.c_str(), n, mode.c_str());
+        if (phase != "Total" && std::find(phase_names.begin(), phase_names.end(), phase) == phase_names.end())
+            Fail("%s:%zu: Error: Unknown phase '%s'", path.c_str(), n, phase.c_str());
+        budget[{mode, phase}] = b;
+    }
+    return budget;
+}
+
+/// Total size of the input files in KiB.
+double InputKiB(const std::vector<std::string>& files) {
+    U64 size = 0;
+    for (const auto& file : files) {
+        struct stat st {};
+        if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) Fail("Could not read %s", file.c_str());
+        size += U64(st.st_size);
+    }
+    return std::max(double(size) / 1024, 1.0 / 1024);
+}
+
+/// Print the allocations made in a mode and check them against the
+/// budget. Returns false if the budget was exceeded.
+bool Report(std::string_view mode, double kib, const std::map<std::pair<std::string, std::string>, Budget>& budget) {
+    bool ok = true;
+
+    auto Row = [&](std::string_view name, U64 count, U64 bytes) {
+        std::fprintf(stderr, "%-22.*s %14zu %16zu %14.2f %16.2f\n", int(name.size()), name.data(), count, bytes, double(count) / kib, double(bytes) / kib);
+        auto b = budget.find({std::string{mode}, std::string{name}});
+        if (b == budget.end()) return;
+        if (double(count) / kib > b->second.allocations || double(bytes) / kib > b->second.bytes) {
+            std::fprintf(stderr, "Error: %.*s exceeds its budget of %.2f allocations and %.2f bytes per KiB\n", int(name.size()), name.data(), b->second.allocations, b->second.bytes);
+            ok = false;
+        }
+    };
+
+    std::fprintf(stderr, "%.*s:\n", int(mode.size()), mode.data());
+    std::fprintf(stderr, "%-22s %14s %16s %14s %16s\n", "Phase", "Allocations", "Bytes", "Allocs/KiB", "Bytes/KiB");
+    U64 total_count = 0;
+    U64 total_bytes = 0;
+    for (U64 i = 0; i < phase_count; i++) {
+        auto count = allocations[i].exchange(0, std::memory_order_relaxed);
+        auto bytes = allocated_bytes[i].exchange(0, std::memory_order_relaxed);
+        total_count += count;
+        total_bytes += bytes;
+        if (count) Row(phase_names[i], count, bytes);
+    }
+    Row("Total", total_count, total_bytes);
+    return ok;
+}
+} // namespace
+} // namespace TeX::test
+
+int main(int argc, char** argv) {
+    using namespace TeX::test;
+    if (argc < 3) Fail("Usage: %s <budget> <file>...", argv[0]);
+
+    const auto                     budget = ReadBudget(argv[1]);
+    const std::vector<std::string> files(argv + 2, argv + argc);
+    const auto                     kib = InputKiB(files);
+    const TeX::Options             opts;
+    bool                           ok = true;
+    for (const auto& mode : modes) {
+        counting.store(true, std::memory_order_relaxed);
+        try {
+            for (const auto& file : files) mode.run(file, opts);
+        } catch (const TeX::ProcessingError& e) {
+            Fail("%s", e.what());
+        }
+        counting.store(false, std::memory_order_relaxed);
+        if (!Report(mode.name, kib, budget)) ok = false;
+    }
+    return ok ? 0 : 1;
+}
+
+/// These aren't inlined into the code above, or GCC thinks that free()
+/// is called on memory that was allocated with new.
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    using namespace TeX::test;
+    if (counting.load(std::memory_order_relaxed)) {
+        auto phase = std::size_t(TeX::current_phase);
+        allocations[phase].fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes[phase].fetch_add(size, std::memory_order_relaxed);
+    }
+
+    if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}